@@ -0,0 +1,562 @@
+#include "builtins.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The builtins behave like the coreutils programs of the same names, and
+ * leave them the rare cases which are not worth repeating here.
+ */
+
+static int builtin_true(const struct command *cmd, FILE *out) {
+    (void)cmd;
+    (void)out;
+    return 0;
+}
+
+static int builtin_false(const struct command *cmd, FILE *out) {
+    (void)cmd;
+    (void)out;
+    return 1;
+}
+
+static int builtin_pwd(const struct command *cmd, FILE *out) {
+    (void)cmd;
+    char buf[PATH_MAX];
+    if (!getcwd(buf, sizeof(buf))) {
+        perror("pwd");
+        return 1;
+    }
+    fprintf(out, "%s\n", buf);
+    return 0;
+}
+
+static bool is_help_arg(const char *arg) {
+    return strcmp(arg, "--help") == 0 || strcmp(arg, "--version") == 0;
+}
+
+static bool is_octal_digit(char c) {
+    return c >= '0' && c <= '7';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Print the escape after a backslash at s and return the position after
+ * it. An octal number has no leading 0 in a printf format, and has one
+ * in echo -e and in %b. \c sets *stop.
+ */
+static const char *print_escape(FILE *out, const char *s, bool in_format, bool *stop) {
+    char c = *s++;
+    int v, n;
+    switch (c) {
+        case 'a': fputc('\a', out); return s;
+        case 'b': fputc('\b', out); return s;
+        case 'c': *stop = true; return s;
+        case 'e': fputc('\x1b', out); return s;
+        case 'f': fputc('\f', out); return s;
+        case 'n': fputc('\n', out); return s;
+        case 'r': fputc('\r', out); return s;
+        case 't': fputc('\t', out); return s;
+        case 'v': fputc('\v', out); return s;
+        case '\\': fputc('\\', out); return s;
+        case '"':
+            if (!in_format) break;
+            fputc('"', out);
+            return s;
+        case 'x':
+            if (hex_value(*s) < 0) break;
+            v = hex_value(*s++);
+            if (hex_value(*s) >= 0) v = v * 16 + hex_value(*s++);
+            fputc(v, out);
+            return s;
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7':
+            v = c - '0';
+            n = (c == '0' && !in_format) ? 3 : 2;
+            for (; n > 0 && is_octal_digit(*s); --n) v = v * 8 + (*s++ - '0');
+            fputc(v, out);
+            return s;
+        case 0:
+            fputc('\\', out);
+            return s - 1;
+    }
+    fputc('\\', out);
+    fputc(c, out);
+    return s;
+}
+
+static void print_escapes(FILE *out, const char *s, bool *stop) {
+    while (*s && !*stop) {
+        if (*s == '\\')
+            s = print_escape(out, s + 1, false, stop);
+        else
+            fputc(*s++, out);
+    }
+}
+
+static bool is_echo_option(const char *arg) {
+    return arg[0] == '-' && arg[1] != 0 && arg[1 + strspn(arg + 1, "neE")] == 0;
+}
+
+static int builtin_echo(const struct command *cmd, FILE *out) {
+    if (cmd->arg_count == 1 && is_help_arg(cmd->args[0]))
+        return BUILTIN_NOT_HANDLED;
+    bool newline = true, escapes = false, stop = false;
+    uint32_t i = 0;
+    for (; i < cmd->arg_count && is_echo_option(cmd->args[i]); ++i) {
+        for (const char *a = cmd->args[i] + 1; *a; ++a) {
+            if (*a == 'n') newline = false;
+            else escapes = (*a == 'e');
+        }
+    }
+    for (; i < cmd->arg_count && !stop; ++i) {
+        if (escapes)
+            print_escapes(out, cmd->args[i], &stop);
+        else
+            fputs(cmd->args[i], out);
+        if (!stop && i + 1 < cmd->arg_count) fputc(' ', out);
+    }
+    if (newline && !stop) fputc('\n', out);
+    return 0;
+}
+
+#define PRINTF_FLAGS "-+ #0'"
+#define PRINTF_MAX_FLAGS 8
+#define PRINTF_MAX_DIGITS 9
+
+/*
+ * The formats with no length modifiers, no \u and with short specs. The
+ * others go to the program.
+ */
+static bool printf_supported(const char *fmt) {
+    while (*fmt) {
+        if (*fmt == '\\') {
+            if (fmt[1] == 'u' || fmt[1] == 'U') return false;
+            fmt += fmt[1] ? 2 : 1;
+            continue;
+        }
+        if (*fmt++ != '%') continue;
+        if (*fmt == '%' || *fmt == 'b') { ++fmt; continue; }
+        size_t n = strspn(fmt, PRINTF_FLAGS);
+        if (n > PRINTF_MAX_FLAGS) return false;
+        fmt += n;
+        if (*fmt == '*') ++fmt;
+        else if ((n = strspn(fmt, "0123456789")) > PRINTF_MAX_DIGITS) return false;
+        else fmt += n;
+        if (*fmt == '.') {
+            ++fmt;
+            if (*fmt == '*') ++fmt;
+            else if ((n = strspn(fmt, "0123456789")) > PRINTF_MAX_DIGITS) return false;
+            else fmt += n;
+        }
+        if (*fmt == 0 || !strchr("diouxXcseEfFgGaA", *fmt)) return false;
+        ++fmt;
+    }
+    return true;
+}
+
+struct printf_args {
+    char **argv;
+    uint32_t count;
+    uint32_t pos;
+    int rc;
+};
+
+static const char *printf_next_arg(struct printf_args *a) {
+    return a->pos < a->count ? a->argv[a->pos++] : NULL;
+}
+
+static void printf_check_number(struct printf_args *a, const char *arg, const char *end) {
+    if (errno == ERANGE)
+        fprintf(stderr, "printf: '%s': %s\n", arg, strerror(ERANGE));
+    else if (end == arg)
+        fprintf(stderr, "printf: '%s': expected a numeric value\n", arg);
+    else if (*end)
+        fprintf(stderr, "printf: '%s': value not completely converted\n", arg);
+    else
+        return;
+    a->rc = 1;
+}
+
+/* A quote in front of an arg gives the code of the char after it. */
+static bool is_char_code(const char *arg) {
+    return arg[0] == '\'' || arg[0] == '"';
+}
+
+static long long printf_int_arg(struct printf_args *a) {
+    const char *arg = printf_next_arg(a);
+    if (!arg) return 0;
+    if (is_char_code(arg)) return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    long long v = strtoll(arg, &end, 0);
+    printf_check_number(a, arg, end);
+    return v;
+}
+
+static unsigned long long printf_uint_arg(struct printf_args *a) {
+    const char *arg = printf_next_arg(a);
+    if (!arg) return 0;
+    if (is_char_code(arg)) return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 0);
+    printf_check_number(a, arg, end);
+    return v;
+}
+
+static long double printf_float_arg(struct printf_args *a) {
+    const char *arg = printf_next_arg(a);
+    if (!arg) return 0;
+    if (is_char_code(arg)) return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    long double v = strtold(arg, &end);
+    printf_check_number(a, arg, end);
+    return v;
+}
+
+/* Copy the digits or take a '*' arg of a width or a precision. */
+static const char *printf_spec_number(const char *fmt, char *spec, size_t *len, struct printf_args *a) {
+    if (*fmt == '*') {
+        *len += sprintf(spec + *len, "%d", (int)printf_int_arg(a));
+        return fmt + 1;
+    }
+    size_t n = strspn(fmt, "0123456789");
+    memcpy(spec + *len, fmt, n);
+    *len += n;
+    return fmt + n;
+}
+
+/* One pass over the format, false when the output is stopped by \c. */
+static bool printf_pass(FILE *out, const char *fmt, struct printf_args *a) {
+    bool stop = false;
+    while (*fmt && !stop) {
+        if (*fmt == '\\') { fmt = print_escape(out, fmt + 1, true, &stop); continue; }
+        if (*fmt != '%') { fputc(*fmt++, out); continue; }
+        ++fmt;
+        if (*fmt == '%') { fputc('%', out); ++fmt; continue; }
+        if (*fmt == 'b') {
+            const char *arg = printf_next_arg(a);
+            if (arg) print_escapes(out, arg, &stop);
+            ++fmt;
+            continue;
+        }
+        /* The spec is rebuilt with the '*' args and the size of the value. */
+        char spec[64];
+        size_t len = 0;
+        spec[len++] = '%';
+        size_t n = strspn(fmt, PRINTF_FLAGS);
+        memcpy(spec + len, fmt, n);
+        len += n;
+        fmt = printf_spec_number(fmt + n, spec, &len, a);
+        if (*fmt == '.') {
+            spec[len++] = *fmt++;
+            fmt = printf_spec_number(fmt, spec, &len, a);
+        }
+        char conv = *fmt++;
+        const char *arg;
+        switch (conv) {
+            case 'd': case 'i':
+                sprintf(spec + len, "ll%c", conv);
+                fprintf(out, spec, printf_int_arg(a));
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                sprintf(spec + len, "ll%c", conv);
+                fprintf(out, spec, printf_uint_arg(a));
+                break;
+            case 'c':
+                strcpy(spec + len, "c");
+                arg = printf_next_arg(a);
+                fprintf(out, spec, arg ? arg[0] : 0);
+                break;
+            case 's':
+                strcpy(spec + len, "s");
+                arg = printf_next_arg(a);
+                fprintf(out, spec, arg ? arg : "");
+                break;
+            default:
+                sprintf(spec + len, "L%c", conv);
+                fprintf(out, spec, printf_float_arg(a));
+                break;
+        }
+    }
+    return !stop;
+}
+
+static int builtin_printf(const struct command *cmd, FILE *out) {
+    if (cmd->arg_count == 0 || strcmp(cmd->args[0], "--") == 0 ||
+        (cmd->arg_count == 1 && is_help_arg(cmd->args[0])) || !printf_supported(cmd->args[0]))
+        return BUILTIN_NOT_HANDLED;
+    struct printf_args a = { cmd->args + 1, cmd->arg_count - 1, 0, 0 };
+    /* The format is reused while it takes args and there are some left. */
+    while (1) {
+        uint32_t pos = a.pos;
+        if (!printf_pass(out, cmd->args[0], &a) || a.pos >= a.count)
+            break;
+        if (a.pos == pos) {
+            fprintf(stderr, "printf: warning: ignoring excess arguments, starting with '%s'\n", a.argv[a.pos]);
+            break;
+        }
+    }
+    return a.rc;
+}
+
+struct test_args {
+    const char *name;
+    char **argv;
+    int count;
+    int pos;
+    bool error;
+};
+
+static const char *test_binary_ops[] = {
+    "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef",
+};
+
+static void test_error(struct test_args *t, const char *msg, const char *arg) {
+    if (t->error) return;
+    t->error = true;
+    if (arg)
+        fprintf(stderr, "%s: '%s': %s\n", t->name, arg, msg);
+    else
+        fprintf(stderr, "%s: %s\n", t->name, msg);
+}
+
+static bool test_is_binary_op(const char *s) {
+    for (size_t i = 0; i < sizeof(test_binary_ops) / sizeof(test_binary_ops[0]); ++i) {
+        if (strcmp(s, test_binary_ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+static bool test_is_unary_op(const char *s) {
+    return s[0] == '-' && s[1] != 0 && s[2] == 0 && strchr("bcdefgGhknOprsSuwxzL", s[1]);
+}
+
+/* Blanks around and a sign are fine, like test takes integers. */
+static long long test_integer(struct test_args *t, const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') ++end;
+    if (end == s || *end || errno == ERANGE) test_error(t, "invalid integer", s);
+    return v;
+}
+
+static bool test_unary(struct test_args *t, char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+        case 'n': return arg[0] != 0;
+        case 'z': return arg[0] == 0;
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (stat(arg, &st) != 0) return false;
+    switch (op) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'e': return true;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'G': return st.st_gid == getegid();
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+    }
+    test_error(t, "unary operator expected", NULL);
+    return false;
+}
+
+/* Like -nt, a file is newer than a missing one. */
+static bool test_newer(const char *l, const char *r) {
+    struct stat ls, rs;
+    if (stat(l, &ls) != 0) return false;
+    if (stat(r, &rs) != 0) return true;
+    return ls.st_mtim.tv_sec > rs.st_mtim.tv_sec ||
+           (ls.st_mtim.tv_sec == rs.st_mtim.tv_sec && ls.st_mtim.tv_nsec > rs.st_mtim.tv_nsec);
+}
+
+static bool test_binary(struct test_args *t, const char *l, const char *op, const char *r) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(l, r) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(l, r) != 0;
+    if (strcmp(op, "-nt") == 0) return test_newer(l, r);
+    if (strcmp(op, "-ot") == 0) return test_newer(r, l);
+    if (strcmp(op, "-ef") == 0) {
+        struct stat ls, rs;
+        return stat(l, &ls) == 0 && stat(r, &rs) == 0 && ls.st_dev == rs.st_dev && ls.st_ino == rs.st_ino;
+    }
+    long long lv = test_integer(t, l), rv = test_integer(t, r);
+    if (strcmp(op, "-eq") == 0) return lv == rv;
+    if (strcmp(op, "-ne") == 0) return lv != rv;
+    if (strcmp(op, "-lt") == 0) return lv < rv;
+    if (strcmp(op, "-le") == 0) return lv <= rv;
+    if (strcmp(op, "-gt") == 0) return lv > rv;
+    return lv >= rv;
+}
+
+static bool test_expr(struct test_args *t);
+static bool test_eval(struct test_args *t, int n);
+
+static const char *test_take(struct test_args *t) {
+    if (t->pos >= t->count) {
+        test_error(t, "argument expected", NULL);
+        return "";
+    }
+    return t->argv[t->pos++];
+}
+
+static bool test_term(struct test_args *t) {
+    const char *arg = test_take(t);
+    if (strcmp(arg, "!") == 0) return !test_term(t);
+    if (strcmp(arg, "(") == 0) {
+        /* The args up to ')' are taken by the POSIX rules too. */
+        if (t->pos >= t->count) {
+            test_error(t, "argument expected", NULL);
+            return false;
+        }
+        int n = 1;
+        for (; t->pos + n < t->count && strcmp(t->argv[t->pos + n], ")") != 0; ++n) {
+            if (n == 4) {
+                n = t->count - t->pos;
+                break;
+            }
+        }
+        bool v = test_eval(t, n);
+        if (t->pos >= t->count || strcmp(t->argv[t->pos], ")") != 0)
+            test_error(t, "')' expected", NULL);
+        ++t->pos;
+        return v;
+    }
+    if (t->pos + 1 < t->count && test_is_binary_op(t->argv[t->pos])) {
+        const char *op = t->argv[t->pos];
+        t->pos += 2;
+        return test_binary(t, arg, op, t->argv[t->pos - 1]);
+    }
+    if (arg[0] == '-' && arg[1] != 0 && arg[2] == 0) {
+        if (!test_is_unary_op(arg)) {
+            test_error(t, "unary operator expected", arg);
+            return false;
+        }
+        if (t->pos >= t->count) {
+            test_error(t, "argument expected", arg);
+            return false;
+        }
+        return test_unary(t, arg[1], t->argv[t->pos++]);
+    }
+    return arg[0] != 0;
+}
+
+static bool test_and(struct test_args *t) {
+    bool v = test_term(t);
+    while (t->pos < t->count && strcmp(t->argv[t->pos], "-a") == 0) {
+        ++t->pos;
+        v = test_term(t) && v;
+    }
+    return v;
+}
+
+static bool test_expr(struct test_args *t) {
+    bool v = test_and(t);
+    while (t->pos < t->count && strcmp(t->argv[t->pos], "-o") == 0) {
+        ++t->pos;
+        v = test_and(t) || v;
+    }
+    return v;
+}
+
+/* Up to 4 args mean what POSIX says, more go by the grammar. */
+static bool test_eval(struct test_args *t, int n) {
+    char **a = t->argv + t->pos;
+    switch (n) {
+        case 0:
+            return false;
+        case 1:
+            ++t->pos;
+            return a[0][0] != 0;
+        case 2:
+            if (strcmp(a[0], "!") == 0) { t->pos += 2; return a[1][0] == 0; }
+            if (!test_is_unary_op(a[0])) {
+                test_error(t, "unary operator expected", a[0]);
+                return false;
+            }
+            t->pos += 2;
+            return test_unary(t, a[0][1], a[1]);
+        case 3:
+            if (test_is_binary_op(a[1])) { t->pos += 3; return test_binary(t, a[0], a[1], a[2]); }
+            if (strcmp(a[0], "!") == 0) { ++t->pos; return !test_eval(t, 2); }
+            if (strcmp(a[0], "(") == 0 && strcmp(a[2], ")") == 0) { t->pos += 3; return a[1][0] != 0; }
+            if (strcmp(a[1], "-a") == 0 || strcmp(a[1], "-o") == 0) return test_expr(t);
+            test_error(t, "binary operator expected", a[1]);
+            return false;
+        case 4:
+            if (strcmp(a[0], "!") == 0) { ++t->pos; return !test_eval(t, 3); }
+            if (strcmp(a[0], "(") == 0 && strcmp(a[3], ")") == 0) {
+                ++t->pos;
+                bool v = test_eval(t, 2);
+                ++t->pos;
+                return v;
+            }
+            return test_expr(t);
+    }
+    return test_expr(t);
+}
+
+static int builtin_test(const struct command *cmd, FILE *out) {
+    (void)out;
+    struct test_args t = { cmd->exe, cmd->args, cmd->arg_count, 0, false };
+    if (strcmp(cmd->exe, "[") == 0) {
+        if (cmd->arg_count == 1 && is_help_arg(cmd->args[0]))
+            return BUILTIN_NOT_HANDLED;
+        if (t.count == 0 || strcmp(t.argv[t.count - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        --t.count;
+    }
+    /* -t asks about the fds of a process, not of the shell. */
+    for (int i = 0; i < t.count; ++i) {
+        if (strcmp(t.argv[i], "-t") == 0) return BUILTIN_NOT_HANDLED;
+    }
+    bool v = test_eval(&t, t.count);
+    if (!t.error && t.pos < t.count)
+        test_error(&t, "extra argument", t.argv[t.pos]);
+    return t.error ? 2 : !v;
+}
+
+static const struct {
+    const char *name;
+    builtin_f run;
+} builtins[] = {
+    {"echo", builtin_echo},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"test", builtin_test},
+    {"[", builtin_test},
+    {"printf", builtin_printf},
+    {"pwd", builtin_pwd},
+};
+
+builtin_f builtin_find(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (strcmp(builtins[i].name, name) == 0) return builtins[i].run;
+    }
+    return NULL;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "parser.h"
+#include <stdio.h>
+
+/*
+ * A command run by the shell itself. It returns the exit code, or
+ * BUILTIN_NOT_HANDLED before any output when the args need something it
+ * doesn't do, then the program of the same name is run instead.
+ */
+typedef int (*builtin_f)(const struct command *cmd, FILE *out);
+
+#define BUILTIN_NOT_HANDLED -1
+
+builtin_f builtin_find(const char *name);
@@ -0,0 +1,221 @@
+#include "builtins.h"
+
+#include "unit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Run a builtin with the given args, its output is stored into @a out
+ * when it is not NULL. Returns the exit code.
+ */
+static int
+run(const char *exe, int count, const char **args, char **out)
+{
+	struct command cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.exe = (char *)exe;
+	cmd.args = (char **)args;
+	cmd.arg_count = count;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&buf, &size);
+	int rc = builtin_find(exe)(&cmd, f);
+	fclose(f);
+	if (out != NULL)
+		*out = buf;
+	else
+		free(buf);
+	return rc;
+}
+
+static int
+run_test(int count, const char **args)
+{
+	return run("test", count, args, NULL);
+}
+
+static bool
+printf_is(int count, const char **args, const char *expected)
+{
+	char *out;
+	int rc = run("printf", count, args, &out);
+	bool res = rc == 0 && strcmp(out, expected) == 0;
+	free(out);
+	return res;
+}
+
+static void
+test_find(void)
+{
+	unit_test_start();
+
+	unit_check(builtin_find("echo") != NULL, "echo");
+	unit_check(builtin_find("[") == builtin_find("test"), "[ is test");
+	unit_check(builtin_find("cat") == NULL, "not a builtin");
+	unit_check(run("true", 0, NULL, NULL) == 0, "true");
+	unit_check(run("false", 0, NULL, NULL) == 1, "false");
+
+	unit_test_finish();
+}
+
+static void
+test_test_arg_count(void)
+{
+	unit_test_start();
+
+	unit_msg("0 args");
+	unit_check(run_test(0, NULL) == 1, "no args is false");
+
+	unit_msg("1 arg: true if it is not empty");
+	unit_check(run_test(1, (const char *[]){""}) == 1, "empty");
+	unit_check(run_test(1, (const char *[]){"x"}) == 0, "a word");
+	unit_check(run_test(1, (const char *[]){"-n"}) == 0, "an operator");
+	unit_check(run_test(1, (const char *[]){"!"}) == 0, "a negation");
+
+	unit_msg("2 args: a negation or a unary operator");
+	unit_check(run_test(2, (const char *[]){"!", ""}) == 0, "! empty");
+	unit_check(run_test(2, (const char *[]){"!", "x"}) == 1, "! word");
+	unit_check(run_test(2, (const char *[]){"-z", ""}) == 0, "-z empty");
+	unit_check(run_test(2, (const char *[]){"-n", ""}) == 1, "-n empty");
+	unit_check(run_test(2, (const char *[]){"-d", "/"}) == 0, "-d");
+	unit_check(run_test(2, (const char *[]){"x", "y"}) == 2,
+		   "not an operator");
+
+	unit_msg("3 args: a binary operator goes first");
+	unit_check(run_test(3, (const char *[]){"a", "=", "a"}) == 0, "=");
+	unit_check(run_test(3, (const char *[]){"a", "!=", "a"}) == 1, "!=");
+	unit_check(run_test(3, (const char *[]){"!", "=", "!"}) == 0,
+		   "! as an operand");
+	unit_check(run_test(3, (const char *[]){"-n", "=", "-n"}) == 0,
+		   "unary op as an operand");
+	unit_check(run_test(3, (const char *[]){"!", "-z", ""}) == 1,
+		   "negated 2 args");
+	unit_check(run_test(3, (const char *[]){"(", "x", ")"}) == 0,
+		   "parens");
+	unit_check(run_test(3, (const char *[]){"(", "", ")"}) == 1,
+		   "parens with empty");
+	unit_check(run_test(3, (const char *[]){"x", "-a", ""}) == 1, "-a");
+	unit_check(run_test(3, (const char *[]){"x", "-o", ""}) == 0, "-o");
+	unit_check(run_test(3, (const char *[]){"1", "-lt", "2"}) == 0, "-lt");
+	unit_check(run_test(3, (const char *[]){"1", "-eq", "x"}) == 2,
+		   "not an integer");
+	unit_check(run_test(3, (const char *[]){"a", "b", "c"}) == 2,
+		   "not a binary operator");
+
+	unit_msg("4 args: a negation or parens around 2 args");
+	unit_check(run_test(4, (const char *[]){"!", "a", "=", "b"}) == 0,
+		   "negated 3 args");
+	unit_check(run_test(4, (const char *[]){"!", "(", "x", ")"}) == 1,
+		   "negated parens");
+	unit_check(run_test(4, (const char *[]){"(", "-z", "x", ")"}) == 1,
+		   "parens around a unary op");
+	unit_check(run_test(4, (const char *[]){"(", "!", "", ")"}) == 0,
+		   "parens around a negation");
+
+	unit_msg("more args go by the grammar");
+	unit_check(run_test(5, (const char *[]){"a", "=", "a", "-a", "x"}) ==
+		   0, "and");
+	unit_check(run_test(7, (const char *[]){"a", "=", "b", "-o", "1",
+						"-gt", "0"}) == 0, "or");
+	unit_check(run_test(5, (const char *[]){"a", "=", "a", "b", "c"}) ==
+		   2, "extra argument");
+
+	unit_msg("brackets");
+	unit_check(run("[", 4, (const char *[]){"a", "=", "a", "]"}, NULL) ==
+		   0, "closed");
+	unit_check(run("[", 3, (const char *[]){"a", "=", "a"}, NULL) == 2,
+		   "missing ]");
+	unit_check(run("[", 1, (const char *[]){"]"}, NULL) == 1, "empty");
+	unit_check(run_test(2, (const char *[]){"-t", "1"}) ==
+		   BUILTIN_NOT_HANDLED, "-t is left to the program");
+
+	unit_test_finish();
+}
+
+static void
+test_printf(void)
+{
+	unit_test_start();
+
+	unit_check(printf_is(1, (const char *[]){"a%%b\n"}, "a%b\n"),
+		   "no args");
+	unit_check(printf_is(3, (const char *[]){"%s|%5s|", "a", "bc"},
+			     "a|   bc|"), "strings");
+	unit_check(printf_is(4, (const char *[]){"%d %x %o", "-12", "255",
+						 "010"}, "-12 ff 10"),
+		   "integers");
+	unit_check(printf_is(3, (const char *[]){"%*d|%.*f", "4", "7"},
+			     "   7|0"), "star and missing args");
+	unit_check(printf_is(2, (const char *[]){"%d", "'A"}, "65"),
+		   "char code");
+	unit_check(printf_is(2, (const char *[]){"%.2f", "1.5"}, "1.50"),
+		   "float");
+	unit_check(printf_is(1, (const char *[]){"\\101\\x42\\t"}, "AB\t"),
+		   "escapes in the format");
+	char *out;
+	unit_check(run("printf", 2, (const char *[]){"%d", "x1"}, &out) == 1 &&
+		   strcmp(out, "0") == 0, "bad number");
+	free(out);
+
+	unit_msg("the format is reused for the extra args");
+	unit_check(printf_is(4, (const char *[]){"%s-", "a", "b", "c"},
+			     "a-b-c-"), "one spec");
+	unit_check(printf_is(4, (const char *[]){"%d %d\n", "1", "2", "3"},
+			     "1 2\n3 0\n"), "not enough for the last pass");
+	unit_check(printf_is(2, (const char *[]){"x\n", "a"}, "x\n"),
+		   "no specs to take the args");
+
+	unit_msg("%%b and \\c");
+	unit_check(printf_is(2, (const char *[]){"%b|", "a\\tb\\0101"},
+			     "a\tbA|"), "%b escapes");
+	unit_check(printf_is(2, (const char *[]){"%s|", "a\\tb"}, "a\\tb|"),
+		   "%s does not");
+	unit_check(printf_is(3, (const char *[]){"%b%s", "x\\cy", "z"}, "x"),
+		   "\\c in %b stops all the output");
+	unit_check(printf_is(3, (const char *[]){"%s\\c%s", "a", "b"}, "a"),
+		   "\\c in the format");
+
+	unit_msg("formats left to the program");
+	unit_check(run("printf", 0, NULL, NULL) == BUILTIN_NOT_HANDLED,
+		   "no format");
+	unit_check(run("printf", 2, (const char *[]){"%ld", "1"}, NULL) ==
+		   BUILTIN_NOT_HANDLED, "length modifier");
+	unit_check(run("printf", 1, (const char *[]){"\\u00e9"}, NULL) ==
+		   BUILTIN_NOT_HANDLED, "\\u");
+	unit_check(run("printf", 2, (const char *[]){"%q", "x"}, NULL) ==
+		   BUILTIN_NOT_HANDLED, "unknown conversion");
+	unit_check(run("printf", 1, (const char *[]){"--help"}, NULL) ==
+		   BUILTIN_NOT_HANDLED, "--help");
+
+	unit_test_finish();
+}
+
+static void
+test_echo(void)
+{
+	unit_test_start();
+
+	char *out;
+	unit_check(run("echo", 2, (const char *[]){"a", "b"}, &out) == 0 &&
+		   strcmp(out, "a b\n") == 0, "words");
+	free(out);
+	unit_check(run("echo", 3, (const char *[]){"-n", "-e", "a\\tb\\c!"},
+		       &out) == 0 && strcmp(out, "a\tb") == 0, "options");
+	free(out);
+	unit_check(run("echo", 2, (const char *[]){"-x", "a"}, &out) == 0 &&
+		   strcmp(out, "-x a\n") == 0, "not an option");
+	free(out);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	test_find();
+	test_test_arg_count();
+	test_printf();
+	test_echo();
+	return 0;
+}
@@ -1,15 +1,9 @@
 #include "parser.h"
 #include <assert.h>
-#include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-    char *buffer;
-    uint32_t size;
-    uint32_t capacity;
-};
-
 enum token_type {
     TOKEN_TYPE_NONE,
     TOKEN_TYPE_STR,
@@ -22,118 +16,307 @@ enum token_type {
     TOKEN_TYPE_BACKGROUND
 };
 
+/* Where the tokenizer stopped when the input has ended. */
+enum token_state {
+    TOKEN_STATE_START,
+    TOKEN_STATE_WORD,
+    TOKEN_STATE_ESCAPE,
+    TOKEN_STATE_OPERATOR,
+    TOKEN_STATE_COMMENT
+};
+
 struct token {
     enum token_type type;
+    enum token_state state;
+    /* Open quote of the word or 0. */
+    char quote;
+    /* First char of an operator waiting for the second one. */
+    char op;
+    /* A plain word is not copied, it points into the input. */
+    const char *str;
     char *data;
     uint32_t size;
     uint32_t capacity;
 };
 
-static char *token_strdup(const struct token *t) {
+enum {
+    /* Ends a run of ordinary chars out of quotes. */
+    CHAR_STOP = 1,
+    /* Ends a run in double quotes. */
+    CHAR_DQUOTE_STOP = 2,
+    /* Ends a run in single quotes. */
+    CHAR_SQUOTE_STOP = 4,
+    CHAR_SPACE = 8,
+};
+
+static const uint8_t char_class[256] = {
+    ['\''] = CHAR_STOP | CHAR_SQUOTE_STOP,
+    ['"'] = CHAR_STOP | CHAR_DQUOTE_STOP,
+    ['\\'] = CHAR_STOP | CHAR_DQUOTE_STOP,
+    ['&'] = CHAR_STOP,
+    ['|'] = CHAR_STOP,
+    ['>'] = CHAR_STOP,
+    ['#'] = CHAR_STOP,
+    [' '] = CHAR_STOP | CHAR_SPACE,
+    ['\t'] = CHAR_STOP | CHAR_SPACE,
+    ['\r'] = CHAR_STOP | CHAR_SPACE,
+    ['\n'] = CHAR_STOP | CHAR_SPACE,
+    ['\v'] = CHAR_SPACE,
+    ['\f'] = CHAR_SPACE,
+};
+
+static const char *skip_run(const char *pos, const char *end, uint8_t stop) {
+    while (pos < end && !(char_class[(uint8_t)*pos] & stop)) ++pos;
+    return pos;
+}
+
+/* What the line expects next. */
+enum line_state {
+    LINE_STATE_BODY,
+    LINE_STATE_OUT_FILE,
+    LINE_STATE_END,
+    LINE_STATE_BACKGROUND_END,
+    /* The rest of a bad line is dropped. */
+    LINE_STATE_SKIP
+};
+
+/*
+ * The input is scanned once. A token or a line cut by the end of the
+ * input keeps its state here and goes on with the next feed, so the
+ * bytes before pos are not needed anymore.
+ */
+struct parser {
+    char *buffer;
+    uint32_t pos;
+    uint32_t size;
+    uint32_t capacity;
+    /* Reused by all the lines, only the strings are copied out of it. */
+    struct token token;
+    struct command_line *line;
+    enum line_state line_state;
+};
+
+#define ARENA_INIT_SIZE 1024
+#define ARENA_ALIGN sizeof(void *)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    char data[];
+};
+
+/*
+ * All the exprs, args and strings of a command line are bumped from
+ * its arena, so the line is freed at once. The line and the first
+ * chunk are one allocation, big lines get more chunks.
+ */
+struct line_arena {
+    struct arena_chunk *chunks;
+    char *pos;
+    char *end;
+    uint32_t chunk_size;
+    struct command_line line;
+    char data[];
+};
+
+static struct command_line *command_line_new(void) {
+    struct line_arena *a = malloc(sizeof(*a) + ARENA_INIT_SIZE);
+    a->chunks = NULL;
+    a->pos = a->data;
+    a->end = a->data + ARENA_INIT_SIZE;
+    a->chunk_size = ARENA_INIT_SIZE;
+    memset(&a->line, 0, sizeof(a->line));
+    return &a->line;
+}
+
+static struct line_arena *line_arena(struct command_line *line) {
+    return (struct line_arena *)((char *)line - offsetof(struct line_arena, line));
+}
+
+static void *arena_alloc(struct line_arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if ((size_t)(a->end - a->pos) < size) {
+        a->chunk_size *= 2;
+        if (a->chunk_size < size) a->chunk_size = size;
+        struct arena_chunk *c = malloc(sizeof(*c) + a->chunk_size);
+        c->next = a->chunks;
+        a->chunks = c;
+        a->pos = c->data;
+        a->end = c->data + a->chunk_size;
+    }
+    void *res = a->pos;
+    a->pos += size;
+    return res;
+}
+
+static void *arena_calloc(struct line_arena *a, size_t size) {
+    return memset(arena_alloc(a, size), 0, size);
+}
+
+static char *token_strdup(struct line_arena *a, const struct token *t) {
     assert(t->type == TOKEN_TYPE_STR && t->size > 0);
-    char *res = malloc(t->size + 1);
-    memcpy(res, t->data, t->size);
+    char *res = arena_alloc(a, t->size + 1);
+    memcpy(res, t->str ? t->str : t->data, t->size);
     res[t->size] = 0;
     return res;
 }
 
-static void token_append(struct token *t, char c) {
-    if (t->size == t->capacity) {
+static void token_append_run(struct token *t, const char *run, uint32_t len) {
+    if (t->capacity - t->size < len) {
         t->capacity = (t->capacity + 1) * 2;
+        if (t->capacity - t->size < len) t->capacity = t->size + len;
         t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
     }
-    t->data[t->size++] = c;
+    memcpy(t->data + t->size, run, len);
+    t->size += len;
+}
+
+static void token_append(struct token *t, char c) {
+    token_append_run(t, &c, 1);
 }
 
 static void token_reset(struct token *t) {
     t->size = 0;
+    t->str = NULL;
     t->type = TOKEN_TYPE_NONE;
+    t->state = TOKEN_STATE_START;
+    t->quote = 0;
+}
+
+/*
+ * The args live in argv after the exe and before NULL, so argv is
+ * ready for exec. The old array stays in the arena, the waste is at
+ * most the used size.
+ */
+static void command_set_argv(struct line_arena *a, struct command *cmd) {
+    char **argv = arena_alloc(a, sizeof(*argv) * (cmd->arg_capacity + 2));
+    argv[0] = cmd->exe;
+    if (cmd->arg_count > 0)
+        memcpy(argv + 1, cmd->args, sizeof(*argv) * cmd->arg_count);
+    argv[cmd->arg_count + 1] = NULL;
+    cmd->argv = argv;
+    cmd->args = argv + 1;
 }
 
-static void command_append_arg(struct command *cmd, char *arg) {
+static void command_append_arg(struct line_arena *a, struct command *cmd, char *arg) {
     if (cmd->arg_count == cmd->arg_capacity) {
         cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-        cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+        command_set_argv(a, cmd);
     }
     cmd->args[cmd->arg_count++] = arg;
+    cmd->args[cmd->arg_count] = NULL;
 }
 
 void command_line_delete(struct command_line *line) {
-    while (line->head) {
-        struct expr *e = line->head;
-        if (e->type == EXPR_TYPE_COMMAND) {
-            struct command *cmd = &e->cmd;
-            free(cmd->exe);
-            for (uint32_t i = 0; i < cmd->arg_count; ++i)
-                free(cmd->args[i]);
-            free(cmd->args);
-        }
-        line->head = e->next;
-        free(e);
+    struct line_arena *a = line_arena(line);
+    while (a->chunks) {
+        struct arena_chunk *c = a->chunks;
+        a->chunks = c->next;
+        free(c);
     }
-    free(line->out_file);
-    free(line);
+    free(a);
 }
 
-static uint32_t parse_token(const char *pos, const char *end, struct token *out) {
-    token_reset(out);
-    const char *begin = pos;
-    while (pos < end) {
-        if (!isspace(*pos)) break;
-        if (*pos == '\n') {
-            out->type = TOKEN_TYPE_NEW_LINE;
-            return pos + 1 - begin;
-        }
-        ++pos;
-    }
-
-    char quote = 0;
+/*
+ * Scan the input up to the end of the next token. When the input ends
+ * first, the state is kept in the token and false is returned. The next
+ * call goes on from there with more input.
+ */
+static bool parse_token(struct token *out, const char **ppos, const char *end) {
+    if (out->type != TOKEN_TYPE_NONE) token_reset(out);
+    const char *pos = *ppos;
+    const char *run;
+    uint8_t stop;
     while (pos < end) {
         char c = *pos;
-        switch (c) {
-            case '\'':
-            case '"':
-                if (!quote) { quote = c; ++pos; if (pos == end) return 0; continue; }
-                if (quote != c) goto append_and_next;
-                out->type = TOKEN_TYPE_STR;
-                return pos + 1 - begin;
-            case '\\':
-                if (quote == '\'') goto append_and_next;
-                if (quote == '"') {
-                    ++pos; if (pos == end) return 0;
-                    c = *pos;
-                    if (c == '\\' || c == '"' || c == '\n') { token_append(out, c); ++pos; continue; }
-                    token_append(out, '\\'); goto append_and_next;
+        switch (out->state) {
+            case TOKEN_STATE_START:
+                if (char_class[(uint8_t)c] & CHAR_SPACE) {
+                    ++pos;
+                    if (c == '\n') { out->type = TOKEN_TYPE_NEW_LINE; goto done; }
+                    continue;
+                }
+                /*
+                 * A word without quotes and escapes is the most common. It
+                 * ends by a space or by an operator, and is given as is
+                 * from the input.
+                 */
+                run = pos;
+                pos = skip_run(pos, end, CHAR_STOP);
+                if (pos < end && pos > run && *pos != '\'' && *pos != '"' && *pos != '\\') {
+                    out->type = TOKEN_TYPE_STR;
+                    out->str = run;
+                    out->size = pos - run;
+                    if (*pos == ' ' || *pos == '\t' || *pos == '\r') ++pos;
+                    goto done;
                 }
-                ++pos; if (pos == end) return 0;
-                c = *pos; if (c == '\n') { ++pos; continue; }
+                if (pos > run) token_append_run(out, run, pos - run);
+                out->state = TOKEN_STATE_WORD;
+                continue;
+            case TOKEN_STATE_ESCAPE:
+                out->state = TOKEN_STATE_WORD;
+                if (out->quote == '"') {
+                    if (c != '\\' && c != '"' && c != '\n') token_append(out, '\\');
+                    goto append_and_next;
+                }
+                if (c == '\n') { ++pos; continue; }
                 goto append_and_next;
-            case '&': case '|': case '>':
-                if (quote) goto append_and_next;
-                if (out->size > 0) { out->type = TOKEN_TYPE_STR; return pos - begin; }
-                ++pos; if (pos == end) return 0;
+            case TOKEN_STATE_OPERATOR:
+                c = out->op;
                 if (*pos == c) {
                     out->type = (c == '&') ? TOKEN_TYPE_AND : (c == '|') ? TOKEN_TYPE_OR : TOKEN_TYPE_OUT_APPEND;
                     ++pos;
                 } else {
                     out->type = (c == '&') ? TOKEN_TYPE_BACKGROUND : (c == '|') ? TOKEN_TYPE_PIPE : TOKEN_TYPE_OUT_NEW;
                 }
-                return pos - begin;
+                goto done;
+            case TOKEN_STATE_COMMENT:
+                run = memchr(pos, '\n', end - pos);
+                if (!run) { pos = end; continue; }
+                pos = run + 1;
+                out->type = TOKEN_TYPE_NEW_LINE;
+                goto done;
+            case TOKEN_STATE_WORD:
+                break;
+        }
+        stop = !out->quote ? CHAR_STOP : out->quote == '"' ? CHAR_DQUOTE_STOP : CHAR_SQUOTE_STOP;
+        if (!(char_class[(uint8_t)c] & stop)) {
+            run = pos;
+            pos = skip_run(pos, end, stop);
+            token_append_run(out, run, pos - run);
+            continue;
+        }
+        switch (c) {
+            case '\'':
+            case '"':
+                if (!out->quote) { out->quote = c; ++pos; continue; }
+                if (out->quote != c) goto append_and_next;
+                ++pos;
+                out->type = TOKEN_TYPE_STR;
+                goto done;
+            case '\\':
+                if (out->quote == '\'') goto append_and_next;
+                ++pos;
+                out->state = TOKEN_STATE_ESCAPE;
+                continue;
+            case '&': case '|': case '>':
+                if (out->quote) goto append_and_next;
+                if (out->size > 0) { out->type = TOKEN_TYPE_STR; goto done; }
+                ++pos;
+                out->op = c;
+                out->state = TOKEN_STATE_OPERATOR;
+                continue;
             case ' ': case '\t': case '\r':
-                if (!quote) { out->type = TOKEN_TYPE_STR; return pos + 1 - begin; }
+                if (!out->quote) { ++pos; out->type = TOKEN_TYPE_STR; goto done; }
                 goto append_and_next;
             case '\n':
-                if (!quote) { out->type = TOKEN_TYPE_STR; return pos - begin; }
+                if (!out->quote) { out->type = TOKEN_TYPE_STR; goto done; }
                 goto append_and_next;
             case '#':
-                if (!quote) {
-                    if (out->size > 0) { out->type = TOKEN_TYPE_STR; return pos - begin; }
+                if (!out->quote) {
+                    if (out->size > 0) { out->type = TOKEN_TYPE_STR; goto done; }
                     ++pos;
-                    while (pos < end) {
-                        if (*pos == '\n') { out->type = TOKEN_TYPE_NEW_LINE; return pos + 1 - begin; }
-                        ++pos;
-                    }
-                    return 0;
+                    out->state = TOKEN_STATE_COMMENT;
+                    continue;
                 }
                 goto append_and_next;
             default: goto append_and_next;
@@ -142,7 +325,12 @@ static uint32_t parse_token(const char *pos, const char *end, struct token *out)
         token_append(out, c);
         ++pos;
     }
-    return 0;
+    *ppos = pos;
+    return false;
+
+done:
+    *ppos = pos;
+    return true;
 }
 
 struct parser *parser_new(void) {
@@ -151,6 +339,13 @@ struct parser *parser_new(void) {
 
 void parser_feed(struct parser *p, const char *str, uint32_t len) {
     uint32_t cap = p->capacity - p->size;
+    if (cap < len && p->pos > 0) {
+        /* The scanned bytes are dropped only when their space is needed. */
+        p->size -= p->pos;
+        memmove(p->buffer, p->buffer + p->pos, p->size);
+        p->pos = 0;
+        cap = p->capacity - p->size;
+    }
     if (cap < len) {
         uint32_t new_capacity = (p->capacity + 1) * 2;
         if (new_capacity - p->size < len)
@@ -162,33 +357,55 @@ void parser_feed(struct parser *p, const char *str, uint32_t len) {
     p->size += len;
 }
 
-static void parser_consume(struct parser *p, uint32_t size) {
-    if (size == p->size) { p->size = 0; return; }
-    memmove(p->buffer, p->buffer + size, p->size - size);
-    p->size -= size;
-}
-
 enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
-    struct command_line *line = calloc(1, sizeof(*line));
-    char *pos = p->buffer;
-    const char *begin = pos;
-    char *end = pos + p->size;
-    struct token token = {0};
+    const char *pos = p->buffer + p->pos;
+    const char *end = p->buffer + p->size;
+    struct token *token = &p->token;
+    enum parser_error err = PARSER_ERR_NONE;
+    *out = NULL;
 
-    while (pos < end) {
-        uint32_t used = parse_token(pos, end, &token);
-        if (used == 0) goto no_line;
-        pos += used;
+    while (parse_token(token, &pos, end)) {
+        if (p->line_state == LINE_STATE_SKIP) {
+            if (token->type == TOKEN_TYPE_NEW_LINE) p->line_state = LINE_STATE_BODY;
+            continue;
+        }
+        if (!p->line) {
+            if (token->type == TOKEN_TYPE_NEW_LINE) continue;
+            p->line = command_line_new();
+        }
+        struct command_line *line = p->line;
+        struct line_arena *arena = line_arena(line);
         struct expr *e;
-        switch (token.type) {
+        switch (p->line_state) {
+            case LINE_STATE_BODY: break;
+            case LINE_STATE_OUT_FILE:
+                if (token->type != TOKEN_TYPE_STR) { err = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG; goto error; }
+                line->out_file = token_strdup(arena, token);
+                p->line_state = LINE_STATE_END;
+                continue;
+            case LINE_STATE_END:
+                if (token->type == TOKEN_TYPE_BACKGROUND) {
+                    line->is_background = true;
+                    p->line_state = LINE_STATE_BACKGROUND_END;
+                    continue;
+                }
+                /* fallthrough */
+            case LINE_STATE_BACKGROUND_END:
+                if (token->type == TOKEN_TYPE_NEW_LINE) goto finished;
+                err = PARSER_ERR_TOO_LATE_ARGUMENTS;
+                goto error;
+            default: assert(false);
+        }
+        switch (token->type) {
             case TOKEN_TYPE_STR:
                 if (line->tail && line->tail->type == EXPR_TYPE_COMMAND) {
-                    command_append_arg(&line->tail->cmd, token_strdup(&token));
+                    command_append_arg(arena, &line->tail->cmd, token_strdup(arena, token));
                     continue;
                 }
-                e = calloc(1, sizeof(*e));
+                e = arena_calloc(arena, sizeof(*e));
                 e->type = EXPR_TYPE_COMMAND;
-                e->cmd.exe = token_strdup(&token);
+                e->cmd.exe = token_strdup(arena, token);
+                command_set_argv(arena, &e->cmd);
                 if (!line->head)
                     line->head = e;
                 else
@@ -199,54 +416,73 @@ enum parser_error parser_pop_next(struct parser *p, struct command_line **out) {
                 if (!line->tail) continue;
                 goto finished;
             case TOKEN_TYPE_PIPE: case TOKEN_TYPE_AND: case TOKEN_TYPE_OR: {
-                if (!line->tail) return token.type == TOKEN_TYPE_PIPE ? PARSER_ERR_PIPE_WITH_NO_LEFT_ARG :
-                                         token.type == TOKEN_TYPE_AND ? PARSER_ERR_AND_WITH_NO_LEFT_ARG : PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-                if (line->tail->type != EXPR_TYPE_COMMAND)
-                    return token.type == TOKEN_TYPE_PIPE ? PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND :
-                           token.type == TOKEN_TYPE_AND ? PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND : PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-                e = calloc(1, sizeof(*e));
-                e->type = (token.type == TOKEN_TYPE_PIPE) ? EXPR_TYPE_PIPE :
-                          (token.type == TOKEN_TYPE_AND) ? EXPR_TYPE_AND : EXPR_TYPE_OR;
+                if (!line->tail) {
+                    err = token->type == TOKEN_TYPE_PIPE ? PARSER_ERR_PIPE_WITH_NO_LEFT_ARG :
+                          token->type == TOKEN_TYPE_AND ? PARSER_ERR_AND_WITH_NO_LEFT_ARG : PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+                    goto error;
+                }
+                if (line->tail->type != EXPR_TYPE_COMMAND) {
+                    err = token->type == TOKEN_TYPE_PIPE ? PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND :
+                          token->type == TOKEN_TYPE_AND ? PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND : PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+                    goto error;
+                }
+                e = arena_calloc(arena, sizeof(*e));
+                e->type = (token->type == TOKEN_TYPE_PIPE) ? EXPR_TYPE_PIPE :
+                          (token->type == TOKEN_TYPE_AND) ? EXPR_TYPE_AND : EXPR_TYPE_OR;
                 line->tail->next = e;
                 line->tail = e;
                 continue;
             }
-            case TOKEN_TYPE_OUT_NEW: case TOKEN_TYPE_OUT_APPEND: case TOKEN_TYPE_BACKGROUND: goto finished;
+            case TOKEN_TYPE_OUT_NEW: case TOKEN_TYPE_OUT_APPEND:
+                line->out_type = (token->type == TOKEN_TYPE_OUT_NEW) ? OUTPUT_TYPE_FILE_NEW : OUTPUT_TYPE_FILE_APPEND;
+                p->line_state = LINE_STATE_OUT_FILE;
+                continue;
+            case TOKEN_TYPE_BACKGROUND:
+                line->is_background = true;
+                p->line_state = LINE_STATE_BACKGROUND_END;
+                continue;
             default: assert(false);
         }
     }
-no_line:
-    free(line);
-    *out = NULL;
+    /* All the input is scanned, the rest of the line is in the state. */
+    p->pos = p->size = 0;
     return PARSER_ERR_NONE;
 
 finished:
-    if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND) {
-        line->out_type = (token.type == TOKEN_TYPE_OUT_NEW) ? OUTPUT_TYPE_FILE_NEW : OUTPUT_TYPE_FILE_APPEND;
-        uint32_t u = parse_token(pos, end, &token);
-        if (u == 0) goto no_line;
-        pos += u;
-        if (token.type != TOKEN_TYPE_STR) return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-        line->out_file = token_strdup(&token);
-        u = parse_token(pos, end, &token);
-        if (u == 0) goto no_line;
-        pos += u;
-    }
-    if (token.type == TOKEN_TYPE_BACKGROUND) {
-        line->is_background = true;
-        uint32_t u = parse_token(pos, end, &token);
-        if (u == 0) goto no_line;
-        pos += u;
-    }
-    if (token.type == TOKEN_TYPE_NEW_LINE) {
-        parser_consume(p, pos - begin);
-        *out = line;
-        return PARSER_ERR_NONE;
+    p->pos = pos - p->buffer;
+    *out = p->line;
+    p->line = NULL;
+    p->line_state = LINE_STATE_BODY;
+    return PARSER_ERR_NONE;
+
+error:
+    /* The line is dropped up to its end, the next one is parsed as usual. */
+    p->pos = pos - p->buffer;
+    command_line_delete(p->line);
+    p->line = NULL;
+    p->line_state = token->type == TOKEN_TYPE_NEW_LINE ? LINE_STATE_BODY : LINE_STATE_SKIP;
+    return err;
+}
+
+const char *parser_error_str(enum parser_error err) {
+    switch (err) {
+        case PARSER_ERR_NONE: return "no error";
+        case PARSER_ERR_PIPE_WITH_NO_LEFT_ARG: return "'|' with no command before it";
+        case PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND: return "'|' after an operator";
+        case PARSER_ERR_AND_WITH_NO_LEFT_ARG: return "'&&' with no command before it";
+        case PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND: return "'&&' after an operator";
+        case PARSER_ERR_OR_WITH_NO_LEFT_ARG: return "'||' with no command before it";
+        case PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND: return "'||' after an operator";
+        case PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG: return "no file name after '>'";
+        case PARSER_ERR_TOO_LATE_ARGUMENTS: return "words after '&' or a redirect";
+        case PARSER_ERR_ENDS_NOT_WITH_A_COMMAND: return "the line ends with an operator";
     }
-    return PARSER_ERR_TOO_LATE_ARGUMENTS;
+    return "unknown error";
 }
 
 void parser_delete(struct parser *p) {
+    if (p->line) command_line_delete(p->line);
+    free(p->token.data);
     free(p->buffer);
     free(p);
 }
@@ -98,6 +98,8 @@ struct command {
     char **args;
     uint32_t arg_count;
     uint32_t arg_capacity;
+    /* The exe, the args and NULL. The args point into it. */
+    char **argv;
 };
 
 enum expr_type {
@@ -131,4 +133,6 @@ void command_line_delete(struct command_line *line);
 struct parser *parser_new(void);
 void parser_feed(struct parser *p, const char *str, uint32_t len);
 enum parser_error parser_pop_next(struct parser *p, struct command_line **out);
+/* A message for the error, to show to the user. */
+const char *parser_error_str(enum parser_error err);
 void parser_delete(struct parser *p);
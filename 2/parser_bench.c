@@ -0,0 +1,100 @@
+/*
+ * Parser throughput on a big generated script.
+ *
+ *     make parser_bench && ./parser_bench
+ *
+ * Each result is a line "name<TAB>value<TAB>unit".
+ */
+#include "parser.h"
+
+#include <stdio.h>
+#include <time.h>
+
+enum {
+	SCRIPT_SIZE = 32 * 1024 * 1024,
+	LONG_TOKEN_SIZE = 10 * 1024 * 1024,
+	REPEAT = 3,
+};
+
+static const char *lines[] = {
+	"echo hello world 12345 some_argument another-argument\n",
+	"ls -la /usr/local/bin | grep -v something | wc -l > out.txt\n",
+	"printf \"quoted text with spaces and \\\"escapes\\\"\\n\" >> log.txt\n",
+	"cmd 'single quoted argument' && other --flag=value || third\n",
+	"# a comment line that is skipped as a whole by the parser\n",
+	"cat file1 file2 file3 file4 file5 | sort | uniq -c | sort -rn &\n",
+	"cd ../some/long/directory/path/name\n",
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, double value, const char *unit)
+{
+	printf("%s\t%.1f\t%s\n", name, value, unit);
+}
+
+/** Feed the script by @a chunk bytes and pop all the lines. */
+static void
+bench_parse(const char *name, const char *script, size_t size,
+	    uint32_t chunk)
+{
+	double best = 0;
+	long count = 0;
+	for (int r = 0; r < REPEAT; ++r) {
+		struct parser *p = parser_new();
+		count = 0;
+		double start = now_sec();
+		for (size_t off = 0; off < size; off += chunk) {
+			uint32_t len = size - off < chunk ? size - off : chunk;
+			parser_feed(p, script + off, len);
+			struct command_line *line;
+			while (parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			       line != NULL) {
+				++count;
+				command_line_delete(line);
+			}
+		}
+		double t = now_sec() - start;
+		parser_delete(p);
+		if (best == 0 || t < best)
+			best = t;
+	}
+	char full[64];
+	snprintf(full, sizeof(full), "%s_mb_per_s", name);
+	report(full, size / best / (1024 * 1024), "mb_per_s");
+	snprintf(full, sizeof(full), "%s_lines", name);
+	report(full, count / best, "lines_per_s");
+}
+
+int
+main(void)
+{
+	char *script = malloc(SCRIPT_SIZE + 256);
+	size_t size = 0;
+	for (int i = 0; size < SCRIPT_SIZE; ++i) {
+		const char *l = lines[i % (sizeof(lines) / sizeof(lines[0]))];
+		size_t len = strlen(l);
+		memcpy(script + size, l, len);
+		size += len;
+	}
+	bench_parse("feed_64k", script, size, 64 * 1024);
+	bench_parse("feed_1k", script, size, 1024);
+	/* One quoted arg over many feeds, a rescan would make it quadratic. */
+	size = 0;
+	memcpy(script, "echo \"", 6);
+	size += 6;
+	memset(script + size, 'x', LONG_TOKEN_SIZE);
+	size += LONG_TOKEN_SIZE;
+	memcpy(script + size, "\"\n", 2);
+	size += 2;
+	bench_parse("long_quoted_1k", script, size, 1024);
+	free(script);
+	return 0;
+}
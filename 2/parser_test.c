@@ -819,6 +819,69 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_error_recovery(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	unit_msg("A bad line and a good one in one feed");
+	const char *str = "| a\necho 1\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) ==
+		   PARSER_ERR_PIPE_WITH_NO_LEFT_ARG, "parse error");
+	unit_check(line == NULL, "no line");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
+	unit_check(line != NULL && strcmp(line->head->cmd.exe, "echo") == 0 &&
+		   line->head->cmd.arg_count == 1 &&
+		   strcmp(line->head->cmd.args[0], "1") == 0, "next line");
+	command_line_delete(line);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		   line == NULL, "no more lines");
+
+	unit_msg("Fed one byte at a time");
+	/*
+	 * The rest of the bad line is dropped by tokens, so the quoted
+	 * newline doesn't end it.
+	 */
+	str = "a | b\nx && && 'y\nz' c\nd 'e\n|' && f\n";
+	int lines = 0, errors = 0;
+	bool is_ok = true;
+	for (size_t i = 0; i < strlen(str); ++i) {
+		parser_feed(p, &str[i], 1);
+		enum parser_error err;
+		while ((err = parser_pop_next(p, &line)) != PARSER_ERR_NONE ||
+		       line != NULL) {
+			if (err != PARSER_ERR_NONE) {
+				is_ok = is_ok && lines == 1 &&
+					err == PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+				++errors;
+				continue;
+			}
+			struct expr *e = line->head;
+			if (lines == 0) {
+				is_ok = is_ok && strcmp(e->cmd.exe, "a") == 0 &&
+					e->next->type == EXPR_TYPE_PIPE &&
+					strcmp(e->next->next->cmd.exe, "b") == 0;
+			} else {
+				is_ok = is_ok && errors == 1 &&
+					strcmp(e->cmd.exe, "d") == 0 &&
+					e->cmd.arg_count == 1 &&
+					strcmp(e->cmd.args[0], "e\n|") == 0 &&
+					e->next->type == EXPR_TYPE_AND &&
+					strcmp(e->next->next->cmd.exe, "f") == 0;
+			}
+			++lines;
+			command_line_delete(line);
+		}
+	}
+	unit_check(is_ok && lines == 2 && errors == 1, "lines around the error");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -834,5 +897,6 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_error_recovery();
 	return 0;
 }
@@ -0,0 +1,101 @@
+/*
+ * Process start rate of the shell on "true | true | ... | true" lines,
+ * by /bin/true and by the true builtin.
+ *
+ *     make && make pipeline_bench && ./pipeline_bench [shell]
+ *
+ * The shell is ./mybash by default. Each result is a line
+ * "name<TAB>value<TAB>unit".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	SPAWN_COUNT = 4000,
+	REPEAT = 3,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, double value, const char *unit)
+{
+	printf("%s\t%.1f\t%s\n", name, value, unit);
+}
+
+/** Run @a shell on a script from @a in and wait for it. */
+static int
+run_shell(const char *shell, FILE *in)
+{
+	pid_t pid = fork();
+	if (pid == -1)
+		return -1;
+	if (pid == 0) {
+		dup2(fileno(in), STDIN_FILENO);
+		execl(shell, shell, (char *)NULL);
+		_exit(127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		return -1;
+	return 0;
+}
+
+/** Pipelines of @a stages @a cmd each, SPAWN_COUNT stages in total. */
+static int
+bench_pipeline(const char *shell, const char *name, const char *cmd,
+	       int stages)
+{
+	FILE *script = tmpfile();
+	if (script == NULL)
+		return -1;
+	for (int i = 0; i < SPAWN_COUNT / stages; ++i) {
+		for (int s = 0; s < stages; ++s)
+			fprintf(script, s == 0 ? "%s" : " | %s", cmd);
+		fputc('\n', script);
+	}
+	fflush(script);
+	double best = 0;
+	for (int r = 0; r < REPEAT; ++r) {
+		rewind(script);
+		double start = now_sec();
+		if (run_shell(shell, script) != 0) {
+			fclose(script);
+			return -1;
+		}
+		double t = now_sec() - start;
+		if (best == 0 || t < best)
+			best = t;
+	}
+	fclose(script);
+	char full[64];
+	snprintf(full, sizeof(full), "%s_%d_spawns_per_s", name, stages);
+	report(full, SPAWN_COUNT / stages * stages / best, "spawns_per_s");
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *shell = argc > 1 ? argv[1] : "./mybash";
+	static const int stages[] = {1, 8, 32};
+	for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i) {
+		if (bench_pipeline(shell, "pipeline", "/bin/true",
+				   stages[i]) != 0 ||
+		    bench_pipeline(shell, "builtin", "true", stages[i]) != 0) {
+			fprintf(stderr, "can't run %s\n", shell);
+			return 1;
+		}
+	}
+	return 0;
+}
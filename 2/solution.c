@@ -1,10 +1,15 @@
 #include "parser.h"
+#include "builtins.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+
+extern char **environ;
 
 struct exec_result {
     int need_exit;
@@ -25,12 +30,307 @@ static int handle_cd_command(const struct expr *expr) {
     return chdir(expr->cmd.args[0]);
 }
 
-static void execute_cmd(const struct expr *expr) {
+/*
+ * Command names resolved to their paths by PATH, so a name is searched
+ * once and not by execvp on every start. It is emptied when PATH changes
+ * and by "hash -r", an entry is dropped when its exec fails.
+ */
+struct cmd_hash_entry {
+    struct cmd_hash_entry *next;
+    uint32_t hash;
+    char *path;
+    char name[];
+};
+
+struct cmd_hash {
+    struct cmd_hash_entry **buckets;
+    uint32_t bucket_count;
+    uint32_t count;
+    /* PATH the entries were found by. */
+    char *path_env;
+};
+
+#define CMD_HASH_INIT_SIZE 64
+
+static struct cmd_hash cmd_hash;
+
+static uint32_t cmd_name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; ++name) {
+        h ^= (uint8_t)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void cmd_hash_clear(void) {
+    for (uint32_t i = 0; i < cmd_hash.bucket_count; ++i) {
+        while (cmd_hash.buckets[i]) {
+            struct cmd_hash_entry *e = cmd_hash.buckets[i];
+            cmd_hash.buckets[i] = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+    free(cmd_hash.buckets);
+    free(cmd_hash.path_env);
+    memset(&cmd_hash, 0, sizeof(cmd_hash));
+}
+
+static struct cmd_hash_entry **cmd_hash_slot(const char *name, uint32_t hash) {
+    struct cmd_hash_entry **slot = &cmd_hash.buckets[hash & (cmd_hash.bucket_count - 1)];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->name, name) != 0))
+        slot = &(*slot)->next;
+    return slot;
+}
+
+static void cmd_hash_grow(void) {
+    uint32_t new_count = cmd_hash.bucket_count ? cmd_hash.bucket_count * 2 : CMD_HASH_INIT_SIZE;
+    struct cmd_hash_entry **buckets = calloc(new_count, sizeof(*buckets));
+    if (!buckets) return;
+    for (uint32_t i = 0; i < cmd_hash.bucket_count; ++i) {
+        while (cmd_hash.buckets[i]) {
+            struct cmd_hash_entry *e = cmd_hash.buckets[i];
+            cmd_hash.buckets[i] = e->next;
+            e->next = buckets[e->hash & (new_count - 1)];
+            buckets[e->hash & (new_count - 1)] = e;
+        }
+    }
+    free(cmd_hash.buckets);
+    cmd_hash.buckets = buckets;
+    cmd_hash.bucket_count = new_count;
+}
+
+/*
+ * The first executable file by PATH, like execvp finds it. A name found
+ * by an empty PATH dir depends on the cwd, so it is not resolved here.
+ */
+static char *cmd_path_search(const char *name, const char *path_env) {
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+    while (1) {
+        const char *dir_end = strchr(dir, ':');
+        if (!dir_end) dir_end = dir + strlen(dir);
+        size_t dir_len = dir_end - dir;
+        if (dir_len == 0)
+            return NULL;
+        char *path = malloc(dir_len + name_len + 2);
+        if (!path) return NULL;
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+            return path;
+        free(path);
+        if (*dir_end == 0)
+            return NULL;
+        dir = dir_end + 1;
+    }
+}
+
+/* The path to exec for a command name, or NULL to leave it to execvp. */
+static const char *cmd_hash_lookup(const char *name) {
+    if (strchr(name, '/'))
+        return NULL;
+    const char *path_env = getenv("PATH");
+    if (!path_env)
+        path_env = "/bin:/usr/bin";
+    if (cmd_hash.path_env && strcmp(cmd_hash.path_env, path_env) != 0)
+        cmd_hash_clear();
+    if (!cmd_hash.path_env && !(cmd_hash.path_env = strdup(path_env)))
+        return NULL;
+
+    uint32_t hash = cmd_name_hash(name);
+    if (cmd_hash.bucket_count) {
+        struct cmd_hash_entry *e = *cmd_hash_slot(name, hash);
+        if (e) return e->path;
+    }
+    char *path = cmd_path_search(name, path_env);
+    if (!path)
+        return NULL;
+    if (cmd_hash.count >= cmd_hash.bucket_count)
+        cmd_hash_grow();
+    size_t name_size = strlen(name) + 1;
+    struct cmd_hash_entry *e = malloc(sizeof(*e) + name_size);
+    if (!cmd_hash.bucket_count || !e) {
+        free(e);
+        free(path);
+        return NULL;
+    }
+    e->hash = hash;
+    e->path = path;
+    memcpy(e->name, name, name_size);
+    struct cmd_hash_entry **slot = &cmd_hash.buckets[hash & (cmd_hash.bucket_count - 1)];
+    e->next = *slot;
+    *slot = e;
+    ++cmd_hash.count;
+    return path;
+}
+
+static void cmd_hash_forget(const char *name) {
+    if (!cmd_hash.bucket_count)
+        return;
+    struct cmd_hash_entry **slot = cmd_hash_slot(name, cmd_name_hash(name));
+    struct cmd_hash_entry *e = *slot;
+    if (!e) return;
+    *slot = e->next;
+    free(e->path);
+    free(e);
+    --cmd_hash.count;
+}
+
+/*
+ * "hash -r" forgets all the paths, "hash name..." resolves the names,
+ * and "hash" prints the known paths.
+ */
+static int handle_hash_command(const struct expr *expr) {
     assert(expr);
-    char **args = calloc(expr->cmd.arg_count + 2, sizeof(char *));
-    args[0] = expr->cmd.exe;
-    memcpy(args + 1, expr->cmd.args, sizeof(char *) * expr->cmd.arg_count);
-    execvp(expr->cmd.exe, args);
+    int rc = 0;
+    if (expr->cmd.arg_count == 0) {
+        for (uint32_t i = 0; i < cmd_hash.bucket_count; ++i) {
+            for (struct cmd_hash_entry *e = cmd_hash.buckets[i]; e; e = e->next)
+                printf("%s\n", e->path);
+        }
+    } else if (strcmp(expr->cmd.args[0], "-r") == 0) {
+        cmd_hash_clear();
+    } else {
+        for (uint32_t i = 0; i < expr->cmd.arg_count; ++i) {
+            if (!cmd_hash_lookup(expr->cmd.args[i])) {
+                fprintf(stderr, "hash: %s: not found\n", expr->cmd.args[i]);
+                rc = 1;
+            }
+        }
+    }
+    fflush(stdout);
+    return rc;
+}
+
+/*
+ * A pipeline stage gets in_fd as stdin, or no stdin when it is -1, and
+ * out_fd or out_file as stdout. close_fd is the parent's end of the
+ * next pipe, or -1.
+ */
+struct stage_fds {
+    int in_fd;
+    int out_fd;
+    int close_fd;
+    const char *out_file;
+    enum output_type out_type;
+};
+
+static int out_file_flags(enum output_type type) {
+    return O_CREAT | O_WRONLY | (type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND);
+}
+
+/*
+ * The parent waits in posix_spawn until the child execs, so opening a
+ * FIFO there would block the shell until a reader comes.
+ */
+static int open_may_block(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+/*
+ * posix_spawn doesn't copy the page tables of the shell like fork does,
+ * the redirects are done by its file actions. Returns -1 if the stage
+ * can't be started this way.
+ */
+static pid_t spawn_cmd(const struct expr *expr, const struct stage_fds *fds) {
+    if (fds->out_file && open_may_block(fds->out_file))
+        return -1;
+    posix_spawn_file_actions_t acts;
+    if (posix_spawn_file_actions_init(&acts) != 0)
+        return -1;
+    int rc = 0;
+    if (fds->in_fd == -1) {
+        rc |= posix_spawn_file_actions_addclose(&acts, STDIN_FILENO);
+    } else if (fds->in_fd != STDIN_FILENO) {
+        rc |= posix_spawn_file_actions_adddup2(&acts, fds->in_fd, STDIN_FILENO);
+        rc |= posix_spawn_file_actions_addclose(&acts, fds->in_fd);
+    }
+    if (fds->out_file) {
+        rc |= posix_spawn_file_actions_addopen(&acts, STDOUT_FILENO, fds->out_file,
+                                               out_file_flags(fds->out_type), 0666);
+    } else if (fds->out_fd != STDOUT_FILENO) {
+        rc |= posix_spawn_file_actions_adddup2(&acts, fds->out_fd, STDOUT_FILENO);
+        rc |= posix_spawn_file_actions_addclose(&acts, fds->out_fd);
+    }
+    if (fds->close_fd != -1)
+        rc |= posix_spawn_file_actions_addclose(&acts, fds->close_fd);
+
+    pid_t pid;
+    const char *path = cmd_hash_lookup(expr->cmd.exe);
+    if (rc == 0) {
+        if (path)
+            rc = posix_spawn(&pid, path, &acts, NULL, expr->cmd.argv, environ);
+        else
+            rc = posix_spawnp(&pid, expr->cmd.exe, &acts, NULL, expr->cmd.argv, environ);
+        /* The file could be gone or changed, fork will search it again. */
+        if (rc != 0 && path)
+            cmd_hash_forget(expr->cmd.exe);
+    }
+    posix_spawn_file_actions_destroy(&acts);
+    return rc == 0 ? pid : -1;
+}
+
+/*
+ * The fallback, a failed redirect or exec ends the child with 1. Also
+ * runs the builtins which are not run in the shell.
+ */
+static pid_t fork_cmd(const struct expr *expr, const struct stage_fds *fds, builtin_f builtin) {
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    if (fds->in_fd == -1) {
+        close(STDIN_FILENO);
+    } else if (fds->in_fd != STDIN_FILENO) {
+        if (dup2(fds->in_fd, STDIN_FILENO) != STDIN_FILENO)
+            exit(1);
+        close(fds->in_fd);
+    }
+
+    int outfd = fds->out_fd;
+    if (fds->out_file) {
+        outfd = open(fds->out_file, out_file_flags(fds->out_type), 0666);
+        if (outfd == -1) exit(1);
+    }
+    if (outfd != STDOUT_FILENO) {
+        if (dup2(outfd, STDOUT_FILENO) != STDOUT_FILENO)
+            exit(1);
+        close(outfd);
+    }
+    if (fds->close_fd != -1) close(fds->close_fd);
+
+    if (builtin) {
+        int rc = builtin(&expr->cmd, stdout);
+        if (rc != BUILTIN_NOT_HANDLED)
+            exit(rc);
+    }
+    execvp(expr->cmd.exe, expr->cmd.argv);
+    exit(1);
+}
+
+/* A builtin run by the shell itself, its output goes to stdout or to the out file. */
+static int run_builtin(builtin_f builtin, const struct expr *expr, const struct stage_fds *fds) {
+    if (!fds->out_file) {
+        int rc = builtin(&expr->cmd, stdout);
+        fflush(stdout);
+        return rc;
+    }
+    int fd = open(fds->out_file, out_file_flags(fds->out_type), 0666);
+    if (fd == -1)
+        return 1;
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return 1;
+    }
+    int rc = builtin(&expr->cmd, out);
+    fclose(out);
+    return rc;
 }
 
 static int is_logical(const struct expr *e) {
@@ -47,6 +347,8 @@ static struct exec_result execute_pipeline(struct expr *start, const char *outfi
         return make_result(0, 1, NULL, 0);
 
     int pipefds[3] = { STDIN_FILENO, STDOUT_FILENO, -1 };
+    /* The exit code of the last stage when the shell has run it. */
+    int builtin_rc = BUILTIN_NOT_HANDLED;
     struct expr *e = start;
 
     while (e && !is_logical(e)) {
@@ -70,6 +372,13 @@ static struct exec_result execute_pipeline(struct expr *start, const char *outfi
                 if (pipefds[1] != STDOUT_FILENO) close(pipefds[1]);
                 return make_result(0, -1, NULL, 0);
             }
+        } else if (strcmp(e->cmd.exe, "hash") == 0 && pids.pa_size == 0 && is_last_in_pipeline(e)) {
+            if (handle_hash_command(e) != 0) {
+                pid_array_free(&pids);
+                if (pipefds[0] != STDIN_FILENO) close(pipefds[0]);
+                if (pipefds[1] != STDOUT_FILENO) close(pipefds[1]);
+                return make_result(0, 1, NULL, 0);
+            }
         } else if (strcmp(e->cmd.exe, "exit") == 0) {
             if (e->next == NULL || is_logical(e->next)) {
                 int one_cmd = (pids.pa_size == 0);
@@ -82,37 +391,36 @@ static struct exec_result execute_pipeline(struct expr *start, const char *outfi
                 return make_result(one_cmd, 0, NULL, 0);
             }
         } else {
-            pid_t pid = fork();
-            if (pid == -1) {
-                pid_array_wait_and_free(&pids);
-                return make_result(1, 1, NULL, 0);
-            }
-
-            if (pid == 0) {
-                pid_array_free(&pids);
-                if (wait_children || pids.pa_size > 0) {
-                    if (dup2(pipefds[0], STDIN_FILENO) != STDIN_FILENO)
-                        exit(1);
-                } else close(pipefds[0]);
-
-                int outfd = pipefds[1];
-                if (is_last_in_pipeline(e)) {
-                    if (outfd != STDOUT_FILENO) close(outfd);
-                    if (outtype != OUTPUT_TYPE_STDOUT) {
-                        outfd = open(outfile, O_CREAT | O_WRONLY | 
-                                     (outtype == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND), 0666);
-                        if (outfd == -1) exit(1);
-                    } else outfd = STDOUT_FILENO;
+            int last = is_last_in_pipeline(e);
+            struct stage_fds fds = {
+                .in_fd = (wait_children || pids.pa_size > 0) ? pipefds[0] : -1,
+                .out_fd = last ? STDOUT_FILENO : pipefds[1],
+                .close_fd = last ? -1 : pipefds[2],
+                .out_file = (last && outtype != OUTPUT_TYPE_STDOUT) ? outfile : NULL,
+                .out_type = outtype,
+            };
+            /*
+             * A builtin in the end of a foreground pipeline is run by the
+             * shell. In other places it can block on a pipe or must run
+             * along with the shell, so it gets a child without exec.
+             */
+            builtin_f builtin = builtin_find(e->cmd.exe);
+            int rc = BUILTIN_NOT_HANDLED;
+            if (builtin && last && wait_children && !(fds.out_file && open_may_block(fds.out_file)))
+                rc = run_builtin(builtin, e, &fds);
+            if (rc != BUILTIN_NOT_HANDLED) {
+                builtin_rc = rc;
+            } else {
+                /* Fork runs what spawn can't, and fails the same way as before. */
+                pid_t pid = builtin ? -1 : spawn_cmd(e, &fds);
+                if (pid == -1)
+                    pid = fork_cmd(e, &fds, builtin);
+                if (pid == -1) {
+                    pid_array_wait_and_free(&pids);
+                    return make_result(1, 1, NULL, 0);
                 }
-
-                if (dup2(outfd, STDOUT_FILENO) != STDOUT_FILENO)
-                    exit(1);
-                if (pipefds[2] != -1) close(pipefds[2]);
-
-                execute_cmd(e);
-                exit(1);
+                pid_array_push(&pids, pid);
             }
-            pid_array_push(&pids, pid);
         }
 
         if (pipefds[0] != STDIN_FILENO) close(pipefds[0]);
@@ -124,8 +432,10 @@ static struct exec_result execute_pipeline(struct expr *start, const char *outfi
     if (pipefds[0] != STDIN_FILENO)
         close(pipefds[0]);
 
-    if (wait_children)
-        return make_result(0, pid_array_wait_and_free(&pids), NULL, 0);
+    if (wait_children) {
+        int rc = pid_array_wait_and_free(&pids);
+        return make_result(0, builtin_rc != BUILTIN_NOT_HANDLED ? builtin_rc : rc, NULL, 0);
+    }
 
     return make_result(0, 0, pids.pa_children, pids.pa_size);
 }
@@ -193,7 +503,14 @@ int main(void) {
         parser_feed(p, buf, rc);
 
         struct command_line *line = NULL;
-        while (parser_pop_next(p, &line) == PARSER_ERR_NONE && line != NULL) {
+        enum parser_error err;
+        while ((err = parser_pop_next(p, &line)) != PARSER_ERR_NONE || line != NULL) {
+            /* The bad line is dropped by the parser, the next ones still run. */
+            if (err != PARSER_ERR_NONE) {
+                fprintf(stderr, "mybash: syntax error: %s\n", parser_error_str(err));
+                last_retcode = 2;
+                continue;
+            }
             struct exec_result res = execute_command_line(line);
             last_retcode = res.return_code;
             command_line_delete(line);
@@ -206,6 +523,7 @@ int main(void) {
             if (res.need_exit) {
                 pid_array_wait_and_free(&bg_proc);
                 parser_delete(p);
+                cmd_hash_clear();
                 return res.return_code;
             }
         }
@@ -214,5 +532,6 @@ int main(void) {
 
     pid_array_wait_and_free(&bg_proc);
     parser_delete(p);
+    cmd_hash_clear();
     return last_retcode;
 }
@@ -0,0 +1,680 @@
+/*
+ * Cost of the userfs operations.
+ *
+ *     make bench && ./bench [group...]
+ *
+ * Without arguments all the groups are run. Each result is a line
+ * "name<TAB>value<TAB>unit". The names and units don't change between
+ * versions, so the outputs of two commits can be compared with join(1).
+ */
+#include "userfs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if UFS_THREAD_SAFE
+#include <pthread.h>
+#endif
+
+enum {
+	FILE_SIZE = 100 * 1024 * 1024,
+	WRITE_CHUNK = 64 * 1024,
+	TAIL_SIZE = 256 * 1024,
+	MAX_SMALL_READ = 64,
+	FILE_COUNT = 100000,
+	OPEN_FDS = 10000,
+	FD_CHURN = 1000000,
+	RANDOM_READS = 1000000,
+	IOV_COUNT = 16,
+	SNAP_FILES = 4,
+	MT_MAX_THREADS = 64,
+	MT_FILE_SIZE = 16 * 1024 * 1024,
+	MT_READS = 200000,
+	MT_READ_SIZE = 4096,
+	SEQ_CHUNK = 4096,
+	RESIZE_REPEAT = 10,
+	CHURN_FILES = 64,
+	CHURN_FILE_SIZE = 4 * 1024 * 1024,
+	IO_FILE_SIZE = 64 * 1024 * 1024,
+	MEM_TOTAL = 64 * 1024 * 1024,
+	MEM_MAX_FILES = 100000,
+	TREE_FANOUT = 100,
+	TREE_LISTS = 10000,
+	CLONES = 100,
+	CLONE_WRITES = 100,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, double value, const char *unit)
+{
+	printf("%s\t%.1f\t%s\n", name, value, unit);
+}
+
+static void
+print_rate(const char *name, long ops, double t)
+{
+	report(name, t * 1e9 / ops, "ns_per_op");
+}
+
+static void
+print_size(const char *name, long bytes)
+{
+	report(name, bytes / 1024.0, "kb");
+}
+
+static void
+print_speed(const char *name, long bytes, double t)
+{
+	report(name, bytes / t / (1024 * 1024), "mb_per_s");
+}
+
+/** Resident memory of the process in bytes. */
+static long
+rss_bytes(void)
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t
+checksum(const void *data, size_t size)
+{
+	const uint64_t *p = data;
+	uint64_t sum = 0;
+	for (size_t i = 0; i < size / sizeof(*p); ++i)
+		sum += p[i];
+	return sum;
+}
+
+/**
+ * Small reads of random size from the tail of a big file. Each read
+ * has to find the block of the current position first.
+ */
+static void
+bench_tail_reads(void)
+{
+	char *buf = malloc(WRITE_CHUNK);
+	for (int i = 0; i < WRITE_CHUNK; ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("big", UFS_CREATE);
+	for (int done = 0; done < FILE_SIZE; done += WRITE_CHUNK)
+		ufs_write(fd, buf, WRITE_CHUNK);
+	ufs_close(fd);
+
+	fd = ufs_open("big", 0);
+	for (int done = 0; done < FILE_SIZE - TAIL_SIZE; done += WRITE_CHUNK)
+		ufs_read(fd, buf, WRITE_CHUNK);
+	srand(1);
+	long reads = 0;
+	double start = now_sec();
+	while (ufs_read(fd, buf, 1 + rand() % MAX_SMALL_READ) > 0)
+		++reads;
+	double t = now_sec() - start;
+	print_rate("tail_reads", reads, t);
+
+	start = now_sec();
+	for (int i = 0; i < RANDOM_READS; ++i)
+		ufs_pread(fd, buf, MAX_SMALL_READ, rand() % FILE_SIZE);
+	print_rate("rand_pread", RANDOM_READS, now_sec() - start);
+
+	/* Many small buffers in one call or one call per buffer. */
+	struct ufs_iovec iov[IOV_COUNT];
+	for (int i = 0; i < IOV_COUNT; ++i) {
+		iov[i].iov_base = buf + i * MAX_SMALL_READ;
+		iov[i].iov_len = MAX_SMALL_READ;
+	}
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	start = now_sec();
+	for (int i = 0; i < RANDOM_READS; ++i) {
+		if (ufs_readv(fd, iov, IOV_COUNT) <= 0)
+			ufs_lseek(fd, 0, UFS_SEEK_SET);
+	}
+	print_rate("readv_16", RANDOM_READS, now_sec() - start);
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	start = now_sec();
+	for (int i = 0; i < RANDOM_READS; ++i) {
+		for (int j = 0; j < IOV_COUNT; ++j) {
+			if (ufs_read(fd, iov[j].iov_base, iov[j].iov_len) <= 0)
+				ufs_lseek(fd, 0, UFS_SEEK_SET);
+		}
+	}
+	print_rate("read_x16", RANDOM_READS, now_sec() - start);
+
+	/* Checksum of the whole file, with a copy and without. */
+	uint64_t sum = 0;
+	ssize_t rc;
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	start = now_sec();
+	while ((rc = ufs_read(fd, buf, WRITE_CHUNK)) > 0)
+		sum += checksum(buf, rc);
+	print_rate("scan_read", FILE_SIZE / WRITE_CHUNK, now_sec() - start);
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	start = now_sec();
+	for (;;) {
+		struct ufs_iovec views[WRITE_CHUNK / 4096];
+		int cnt = WRITE_CHUNK / 4096;
+		struct ufs_pin *pin;
+		rc = ufs_read_view(fd, WRITE_CHUNK, views, &cnt, &pin);
+		for (int i = 0; i < cnt; ++i)
+			sum -= checksum(views[i].iov_base, views[i].iov_len);
+		ufs_pin_release(pin);
+		if (rc <= 0)
+			break;
+	}
+	print_rate("scan_view", FILE_SIZE / WRITE_CHUNK, now_sec() - start);
+	if (sum != 0)
+		printf("checksum mismatch\n");
+	ufs_close(fd);
+	ufs_delete("big");
+	free(buf);
+}
+
+/** Create, open and delete many files by name. */
+static void
+bench_files(void)
+{
+	char name[32];
+	double start = now_sec();
+	for (int i = 0; i < FILE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "file_%d", i);
+		ufs_close(ufs_open(name, UFS_CREATE));
+	}
+	print_rate("create", FILE_COUNT, now_sec() - start);
+
+	srand(1);
+	start = now_sec();
+	for (int i = 0; i < FILE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "file_%d", rand() % FILE_COUNT);
+		ufs_close(ufs_open(name, 0));
+	}
+	print_rate("open", FILE_COUNT, now_sec() - start);
+
+	start = now_sec();
+	for (int i = 0; i < FILE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "file_%d", i);
+		ufs_delete(name);
+	}
+	print_rate("delete", FILE_COUNT, now_sec() - start);
+}
+
+/**
+ * Files in a two level tree, TREE_FANOUT entries per directory. Open
+ * by path and list a directory while the whole tree exists.
+ */
+static void
+bench_tree(void)
+{
+	char name[64];
+	int files = TREE_FANOUT * TREE_FANOUT;
+	double start = now_sec();
+	for (int i = 0; i < TREE_FANOUT; ++i) {
+		snprintf(name, sizeof(name), "dir_%d", i);
+		ufs_mkdir(name);
+		for (int j = 0; j < TREE_FANOUT; ++j) {
+			snprintf(name, sizeof(name), "dir_%d/file_%d", i, j);
+			ufs_close(ufs_open(name, UFS_CREATE));
+		}
+	}
+	print_rate("tree_create", files, now_sec() - start);
+
+	srand(1);
+	start = now_sec();
+	for (int i = 0; i < files; ++i) {
+		snprintf(name, sizeof(name), "dir_%d/file_%d",
+			 rand() % TREE_FANOUT, rand() % TREE_FANOUT);
+		ufs_close(ufs_open(name, 0));
+	}
+	print_rate("tree_open", files, now_sec() - start);
+
+	long entries = 0;
+	start = now_sec();
+	for (int i = 0; i < TREE_LISTS; ++i) {
+		snprintf(name, sizeof(name), "dir_%d", rand() % TREE_FANOUT);
+		struct ufs_dir *dir = ufs_opendir(name);
+		while (ufs_readdir(dir) != NULL)
+			++entries;
+		ufs_closedir(dir);
+	}
+	print_rate("tree_list", TREE_LISTS, now_sec() - start);
+	if (entries != (long)TREE_LISTS * TREE_FANOUT)
+		printf("wrong listing\n");
+
+	for (int i = 0; i < TREE_FANOUT; ++i) {
+		for (int j = 0; j < TREE_FANOUT; ++j) {
+			snprintf(name, sizeof(name), "dir_%d/file_%d", i, j);
+			ufs_delete(name);
+		}
+		snprintf(name, sizeof(name), "dir_%d", i);
+		ufs_rmdir(name);
+	}
+}
+
+/**
+ * Versions of a big file: clone it many times and change a few blocks
+ * in each clone. The memory should grow only by the changed blocks.
+ */
+static void
+bench_clone(void)
+{
+	char *buf = malloc(WRITE_CHUNK);
+	for (int i = 0; i < WRITE_CHUNK; ++i)
+		buf[i] = i % 251;
+	int fd = ufs_open("orig", UFS_CREATE);
+	for (int done = 0; done < FILE_SIZE; done += WRITE_CHUNK)
+		ufs_write(fd, buf, WRITE_CHUNK);
+	ufs_close(fd);
+
+	char name[32];
+	long base = rss_bytes();
+	double start = now_sec();
+	for (int i = 0; i < CLONES; ++i) {
+		snprintf(name, sizeof(name), "clone_%d", i);
+		ufs_clone("orig", name);
+	}
+	print_rate("clone_100m", CLONES, now_sec() - start);
+	print_size("clone_rss", rss_bytes() - base);
+
+	srand(1);
+	base = rss_bytes();
+	start = now_sec();
+	for (int i = 0; i < CLONES; ++i) {
+		snprintf(name, sizeof(name), "clone_%d", i);
+		fd = ufs_open(name, 0);
+		for (int j = 0; j < CLONE_WRITES; ++j)
+			ufs_pwrite(fd, buf, 4096, rand() % (FILE_SIZE / 4096) * 4096);
+		ufs_close(fd);
+	}
+	print_rate("cow_write", CLONES * CLONE_WRITES, now_sec() - start);
+	report("cow_mem_per_write", (double)(rss_bytes() - base) / CLONES /
+	       CLONE_WRITES, "bytes");
+	for (int i = 0; i < CLONES; ++i) {
+		snprintf(name, sizeof(name), "clone_%d", i);
+		ufs_delete(name);
+	}
+	ufs_delete("orig");
+	free(buf);
+}
+
+/** Sequential 4KB writes of a big file and its resize from scratch. */
+static void
+bench_grow(void)
+{
+	static char buf[SEQ_CHUNK];
+	int fd = ufs_open("grow", UFS_CREATE);
+	double start = now_sec();
+	for (int done = 0; done < FILE_SIZE; done += SEQ_CHUNK)
+		ufs_write(fd, buf, SEQ_CHUNK);
+	print_rate("seq_write", FILE_SIZE / SEQ_CHUNK, now_sec() - start);
+
+	double t = 0;
+	for (int i = 0; i < RESIZE_REPEAT; ++i) {
+		ufs_resize(fd, 0);
+		start = now_sec();
+		ufs_resize(fd, FILE_SIZE);
+		t += now_sec() - start;
+	}
+	print_rate("resize_100m", RESIZE_REPEAT, t);
+	ufs_close(fd);
+	ufs_delete("grow");
+}
+
+/**
+ * Close and open again random descriptors of a big descriptor table,
+ * then churn at the table end, around the resize border.
+ */
+static void
+bench_fds(void)
+{
+	static int fds[OPEN_FDS];
+	for (int i = 0; i < OPEN_FDS; ++i)
+		fds[i] = ufs_open("fds", UFS_CREATE);
+	srand(1);
+	double start = now_sec();
+	for (int i = 0; i < FD_CHURN; ++i) {
+		int *fd = &fds[rand() % OPEN_FDS];
+		ufs_close(*fd);
+		*fd = ufs_open("fds", 0);
+	}
+	print_rate("fd_churn", FD_CHURN, now_sec() - start);
+
+	start = now_sec();
+	for (int i = 0; i < FD_CHURN; ++i)
+		ufs_close(ufs_open("fds", 0));
+	print_rate("fd_tail", FD_CHURN, now_sec() - start);
+	for (int i = 0; i < OPEN_FDS; ++i)
+		ufs_close(fds[i]);
+	ufs_delete("fds");
+}
+
+/** Save a few big files and load them back. */
+static void
+bench_snapshot(void)
+{
+	const char *path = "bench_snapshot.img";
+	char *buf = malloc(WRITE_CHUNK);
+	for (int i = 0; i < WRITE_CHUNK; ++i)
+		buf[i] = i % 251;
+	char name[32];
+	for (int i = 0; i < SNAP_FILES; ++i) {
+		snprintf(name, sizeof(name), "snap_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		for (int done = 0; done < FILE_SIZE; done += WRITE_CHUNK)
+			ufs_write(fd, buf, WRITE_CHUNK);
+		ufs_close(fd);
+	}
+	double start = now_sec();
+	ufs_snapshot(path);
+	print_rate("snapshot", SNAP_FILES, now_sec() - start);
+	for (int i = 0; i < SNAP_FILES; ++i) {
+		snprintf(name, sizeof(name), "snap_%d", i);
+		ufs_delete(name);
+	}
+
+	start = now_sec();
+	ufs_restore(path);
+	print_rate("restore", SNAP_FILES, now_sec() - start);
+	start = now_sec();
+	for (int i = 0; i < SNAP_FILES; ++i) {
+		snprintf(name, sizeof(name), "snap_%d", i);
+		int fd = ufs_open(name, 0);
+		while (ufs_read(fd, buf, WRITE_CHUNK) > 0)
+			;
+		ufs_close(fd);
+		ufs_delete(name);
+	}
+	print_rate("restored_scan", SNAP_FILES, now_sec() - start);
+	unlink(path);
+	free(buf);
+}
+
+/**
+ * Sequential and random reads and writes of a big file with IO of
+ * different size.
+ */
+static void
+bench_io(void)
+{
+	static const int sizes[] = {512, 4096, 64 * 1024, 1024 * 1024};
+	char *buf = malloc(1024 * 1024);
+	memset(buf, 'x', 1024 * 1024);
+	char name[32];
+	srand(1);
+	for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+		int size = sizes[k];
+		int ops = IO_FILE_SIZE / size;
+		int fd = ufs_open("io", UFS_CREATE);
+		double start = now_sec();
+		for (int i = 0; i < ops; ++i)
+			ufs_write(fd, buf, size);
+		snprintf(name, sizeof(name), "seq_write_%d", size);
+		print_speed(name, IO_FILE_SIZE, now_sec() - start);
+
+		ufs_lseek(fd, 0, UFS_SEEK_SET);
+		start = now_sec();
+		for (int i = 0; i < ops; ++i)
+			ufs_read(fd, buf, size);
+		snprintf(name, sizeof(name), "seq_read_%d", size);
+		print_speed(name, IO_FILE_SIZE, now_sec() - start);
+
+		start = now_sec();
+		for (int i = 0; i < ops; ++i)
+			ufs_pwrite(fd, buf, size, rand() % (ops - 1) * size);
+		snprintf(name, sizeof(name), "rand_write_%d", size);
+		print_speed(name, IO_FILE_SIZE, now_sec() - start);
+
+		start = now_sec();
+		for (int i = 0; i < ops; ++i)
+			ufs_pread(fd, buf, size, rand() % (ops - 1) * size);
+		snprintf(name, sizeof(name), "rand_read_%d", size);
+		print_speed(name, IO_FILE_SIZE, now_sec() - start);
+		ufs_close(fd);
+		ufs_delete("io");
+	}
+	free(buf);
+}
+
+/**
+ * Memory taken per stored byte, for many small files and for a few
+ * big ones. 1.0 would mean no overhead at all.
+ */
+static void
+bench_memory(void)
+{
+	static const int sizes[] = {100, 4096, 64 * 1024, 16 * 1024 * 1024};
+	char *buf = malloc(16 * 1024 * 1024);
+	memset(buf, 'x', 16 * 1024 * 1024);
+	char name[32];
+	for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+		int size = sizes[k];
+		int count = MEM_TOTAL / size;
+		if (count > MEM_MAX_FILES)
+			count = MEM_MAX_FILES;
+#ifdef __GLIBC__
+		malloc_trim(0);
+#endif
+		long base = rss_bytes();
+		for (int i = 0; i < count; ++i) {
+			snprintf(name, sizeof(name), "mem_%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			ufs_write(fd, buf, size);
+			ufs_close(fd);
+		}
+		snprintf(name, sizeof(name), "mem_per_byte_%d", size);
+		report(name, (double)(rss_bytes() - base) / count / size,
+		       "ratio");
+		for (int i = 0; i < count; ++i) {
+			snprintf(name, sizeof(name), "mem_%d", i);
+			ufs_delete(name);
+		}
+	}
+	free(buf);
+}
+
+/**
+ * Grow files interleaved with small ones, delete the big files and
+ * see how much memory is kept. Then a scan of a big file, to see the
+ * cost of the storage for the reads.
+ */
+static void
+bench_storage_one(enum ufs_storage kind, const char *kind_name)
+{
+	char *buf = malloc(WRITE_CHUNK);
+	for (int i = 0; i < WRITE_CHUNK; ++i)
+		buf[i] = i % 251;
+	char name[32];
+	ufs_set_storage(kind);
+	long base = rss_bytes();
+	for (int i = 0; i < CHURN_FILES; ++i) {
+		snprintf(name, sizeof(name), "churn_%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		for (int done = 0; done < CHURN_FILE_SIZE; done += WRITE_CHUNK)
+			ufs_write(fd, buf, WRITE_CHUNK);
+		ufs_close(fd);
+		snprintf(name, sizeof(name), "small_%d", i);
+		fd = ufs_open(name, UFS_CREATE);
+		ufs_write(fd, buf, 100);
+		ufs_close(fd);
+	}
+	long peak = rss_bytes();
+	for (int i = 0; i < CHURN_FILES; ++i) {
+		snprintf(name, sizeof(name), "churn_%d", i);
+		ufs_delete(name);
+	}
+	snprintf(name, sizeof(name), "rss_%s", kind_name);
+	print_size(name, rss_bytes() - base);
+	snprintf(name, sizeof(name), "peak_%s", kind_name);
+	print_size(name, peak - base);
+
+	int fd = ufs_open("scan", UFS_CREATE);
+	for (int done = 0; done < FILE_SIZE; done += WRITE_CHUNK)
+		ufs_write(fd, buf, WRITE_CHUNK);
+	ufs_lseek(fd, 0, UFS_SEEK_SET);
+	uint64_t sum = 0;
+	ssize_t rc;
+	double start = now_sec();
+	while ((rc = ufs_read(fd, buf, WRITE_CHUNK)) > 0)
+		sum += checksum(buf, rc);
+	snprintf(name, sizeof(name), "scan_%s", kind_name);
+	print_rate(name, FILE_SIZE / WRITE_CHUNK, now_sec() - start);
+	if (sum == 0)
+		printf("empty scan\n");
+	ufs_close(fd);
+	ufs_delete("scan");
+	for (int i = 0; i < CHURN_FILES; ++i) {
+		snprintf(name, sizeof(name), "small_%d", i);
+		ufs_delete(name);
+	}
+	free(buf);
+}
+
+/**
+ * Each block storage in an own process. Otherwise the memory kept by
+ * the allocator and the pages touched by one storage are counted for
+ * the next one.
+ */
+static void
+bench_storage(void)
+{
+	static const char *names[] = {"heap", "mmap", "mmap_huge"};
+	static const enum ufs_storage kinds[] = {
+		UFS_STORAGE_HEAP, UFS_STORAGE_MMAP, UFS_STORAGE_MMAP_HUGE,
+	};
+	for (int k = 0; k < 3; ++k) {
+		/* Or the child prints the buffered lines once again. */
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return;
+		}
+		if (pid == 0) {
+			bench_storage_one(kinds[k], names[k]);
+			fflush(stdout);
+			_exit(0);
+		}
+		waitpid(pid, NULL, 0);
+	}
+}
+
+#if UFS_THREAD_SAFE
+
+struct mt_arg {
+	const char *name;
+	unsigned seed;
+};
+
+static void *
+mt_read_f(void *arg)
+{
+	struct mt_arg *a = arg;
+	static __thread char buf[MT_READ_SIZE];
+	int fd = ufs_open(a->name, 0);
+	for (int i = 0; i < MT_READS; ++i) {
+		size_t offset = rand_r(&a->seed) % (MT_FILE_SIZE - MT_READ_SIZE);
+		ufs_pread(fd, buf, MT_READ_SIZE, offset);
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+/**
+ * 4KB preads from several threads, of a file per thread and of one
+ * shared file. Each thread does the same amount of reads, so with
+ * perfect scaling the time stays the same.
+ */
+static void
+bench_threads(void)
+{
+	static char names[MT_MAX_THREADS][16];
+	char *buf = calloc(1, WRITE_CHUNK);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = cpus > MT_MAX_THREADS ? MT_MAX_THREADS : (int)cpus;
+	for (int i = 0; i < max_threads; ++i) {
+		snprintf(names[i], sizeof(names[i]), "mt_%d", i);
+		int fd = ufs_open(names[i], UFS_CREATE);
+		for (int done = 0; done < MT_FILE_SIZE; done += WRITE_CHUNK)
+			ufs_write(fd, buf, WRITE_CHUNK);
+		ufs_close(fd);
+	}
+	free(buf);
+
+	for (int shared = 0; shared < 2; ++shared) {
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			pthread_t tids[MT_MAX_THREADS];
+			struct mt_arg args[MT_MAX_THREADS];
+			double start = now_sec();
+			for (int i = 0; i < threads; ++i) {
+				args[i].name = names[shared ? 0 : i];
+				args[i].seed = i + 1;
+				pthread_create(&tids[i], NULL, mt_read_f, &args[i]);
+			}
+			for (int i = 0; i < threads; ++i)
+				pthread_join(tids[i], NULL);
+			char name[32];
+			snprintf(name, sizeof(name), "%s_t%d",
+				 shared ? "mt_shared" : "mt_own", threads);
+			print_rate(name, (long)threads * MT_READS,
+				   (now_sec() - start) * threads);
+		}
+	}
+	for (int i = 0; i < max_threads; ++i)
+		ufs_delete(names[i]);
+}
+
+#endif
+
+static const struct {
+	const char *name;
+	void (*f)(void);
+} groups[] = {
+	/* Memory goes first, while the heap is clean. */
+	{"memory", bench_memory},
+	{"io", bench_io},
+	{"tail", bench_tail_reads},
+	{"files", bench_files},
+	{"tree", bench_tree},
+	{"fds", bench_fds},
+	{"grow", bench_grow},
+	{"clone", bench_clone},
+	{"snapshot", bench_snapshot},
+	{"storage", bench_storage},
+#if UFS_THREAD_SAFE
+	{"threads", bench_threads},
+#endif
+};
+
+int
+main(int argc, char **argv)
+{
+	for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); ++i) {
+		bool is_selected = argc == 1;
+		for (int j = 1; j < argc && !is_selected; ++j)
+			is_selected = strcmp(argv[j], groups[i].name) == 0;
+		if (is_selected)
+			groups[i].f();
+	}
+	ufs_destroy();
+	return 0;
+}
@@ -2,7 +2,13 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#if UFS_THREAD_SAFE
+#include <pthread.h>
+#endif
 
 static void
 test_open(void)
@@ -469,6 +475,773 @@ test_resize(void)
 #endif
 }
 
+static void
+test_resize_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+	/*
+	 * Grow a small file a lot, write into the middle of the hole,
+	 * then cut inside the written data and grow again.
+	 */
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "head", 4) != 4);
+	enum { size = 1024 * 1024, mid = size / 2 + 100 };
+	unit_check(ufs_resize(fd, size) == 0, "grow to 1MB");
+	unit_fail_if(ufs_resize(fd, mid) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", 0);
+	unit_fail_if(fd == -1);
+	static char buf[size + 100];
+	unit_fail_if(ufs_read(fd, buf, mid) != mid);
+	unit_fail_if(ufs_write(fd, "middle", 6) != 6);
+	unit_fail_if(ufs_resize(fd, size) != 0);
+	unit_fail_if(ufs_resize(fd, mid + 3) != 0);
+	unit_fail_if(ufs_resize(fd, size) != 0);
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == size, "read all");
+	bool is_ok = memcmp(buf, "head", 4) == 0 &&
+		memcmp(buf + mid, "mid", 3) == 0;
+	for (int i = 4; i < size && is_ok; ++i)
+		is_ok = (i >= mid && i < mid + 3) || buf[i] == 0;
+	unit_check(is_ok, "holes and the cut off data read as zeros");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	char buf[32];
+	unit_check(ufs_pread(fd, buf, 4, 3) == 4 && memcmp(buf, "3456", 4) == 0,
+		   "pread in the middle");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 8) == 2, "pread till EOF");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 100) == 0,
+		   "pread past EOF");
+	unit_check(ufs_pwrite(fd, "ab", 2, 1) == 2, "pwrite");
+	unit_check(ufs_write(fd, "X", 1) == 1, "pwrite did not move the position");
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_CUR) == 11, "position");
+	/*
+	 * Seek and read or write from the new position.
+	 */
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_SET) == 0, "seek to start");
+	unit_check(ufs_read(fd, buf, 11) == 11 &&
+		   memcmp(buf, "0ab3456789X", 11) == 0, "read all");
+	unit_check(ufs_lseek(fd, -2, UFS_SEEK_END) == 9, "seek from the end");
+	unit_check(ufs_read(fd, buf, 5) == 2 && memcmp(buf, "9X", 2) == 0,
+		   "read the tail");
+	unit_check(ufs_lseek(fd, -1, UFS_SEEK_SET) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "negative position");
+	unit_check(ufs_lseek(fd, 0, 100) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "bad whence");
+	unit_check(ufs_lseek(fd, 5000, UFS_SEEK_END) == 5011, "past the end");
+	unit_check(ufs_write(fd, "end", 3) == 3, "write past the end");
+	unit_check(ufs_pread(fd, buf, 4, 5009) == 4 &&
+		   memcmp(buf, "\0\0en", 4) == 0, "the gap is zeros");
+	/*
+	 * Vectored IO.
+	 */
+	char a[3], b[5], c[100];
+	struct ufs_iovec iov[] = {{a, 3}, {b, 0}, {b, 5}, {c, sizeof(c)}};
+	unit_fail_if(ufs_lseek(fd, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_readv(fd, iov, 4) == 108, "readv");
+	unit_check(memcmp(a, "0ab", 3) == 0 && memcmp(b, "34567", 5) == 0 &&
+		   memcmp(c, "89X", 3) == 0, "readv filled all buffers");
+	unit_check(ufs_readv(fd, iov, -1) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "bad count");
+	struct ufs_iovec out[] = {{"he", 2}, {"llo", 3}};
+	unit_fail_if(ufs_lseek(fd, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_writev(fd, out, 2) == 5, "writev");
+	unit_check(ufs_pread(fd, buf, 6, 0) == 6 &&
+		   memcmp(buf, "hello5", 6) == 0, "writev wrote in order");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_read_view(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	enum { size = 3 * 4096 + 100 };
+	static char data[size];
+	for (int i = 0; i < size; ++i)
+		data[i] = i % 251;
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_lseek(fd, 10, UFS_SEEK_SET) != 10);
+
+	struct ufs_iovec iov[8];
+	int cnt = 8;
+	struct ufs_pin *pin;
+	unit_check(ufs_read_view(fd, size, iov, &cnt, &pin) == size - 10,
+		   "view till EOF");
+	size_t total = 0;
+	bool is_ok = true;
+	for (int i = 0; i < cnt; ++i) {
+		is_ok = is_ok && memcmp(iov[i].iov_base, data + 10 + total,
+					iov[i].iov_len) == 0;
+		total += iov[i].iov_len;
+	}
+	unit_check(is_ok && total == size - 10, "view has the data");
+	unit_check(ufs_lseek(fd, 0, UFS_SEEK_CUR) == size, "position moved");
+	/*
+	 * The pinned memory survives the file.
+	 */
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	total = 0;
+	for (int i = 0; i < cnt; ++i) {
+		is_ok = is_ok && memcmp(iov[i].iov_base, data + 10 + total,
+					iov[i].iov_len) == 0;
+		total += iov[i].iov_len;
+	}
+	unit_check(is_ok, "pinned data is alive after delete");
+	ufs_pin_release(pin);
+	/*
+	 * Holes and too few buffers.
+	 */
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_resize(fd, 3 * 4096) != 0);
+	cnt = 2;
+	unit_check(ufs_read_view(fd, size, iov, &cnt, &pin) == 2 * 4096 &&
+		   cnt == 2, "view is limited by the buffer count");
+	for (int i = 0; i < cnt; ++i) {
+		for (size_t j = 0; j < iov[i].iov_len; ++j)
+			is_ok = is_ok && ((char *)iov[i].iov_base)[j] == 0;
+	}
+	unit_check(is_ok, "holes are zeros");
+	ufs_pin_release(pin);
+	cnt = 0;
+	unit_check(ufs_read_view(fd, size, iov, &cnt, &pin) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "no buffers");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	const char *path = "test_snapshot.img";
+	enum { big_size = 3 * 4096 + 7 };
+	static char big[big_size], buf[big_size + 100];
+	for (int i = 0; i < big_size; ++i)
+		big[i] = i % 251;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, big, big_size) != big_size);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, "x", 1, 100000) != 1);
+	unit_fail_if(ufs_close(fd) != 0);
+	int deleted = ufs_open("deleted", UFS_CREATE);
+	unit_fail_if(deleted == -1);
+	unit_fail_if(ufs_delete("deleted") != 0);
+
+	unit_check(ufs_snapshot(path) == 0, "snapshot");
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+	/* An opened file is replaced by the restored one. */
+	fd = ufs_open("empty", 0);
+	unit_fail_if(ufs_write(fd, "old", 3) != 3);
+	unit_check(ufs_restore(path) == 0, "restore");
+
+	int fd2 = ufs_open("big", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == big_size &&
+		   memcmp(buf, big, big_size) == 0, "restored big file");
+	/* Write into the restored data and append to it. */
+	unit_fail_if(ufs_pwrite(fd2, "new", 3, 4096) != 3);
+	unit_fail_if(ufs_write(fd2, big, big_size) != big_size);
+	unit_check(ufs_pread(fd2, buf, 5, 4095) == 5 && buf[0] == big[4095] &&
+		   memcmp(buf + 1, "new", 3) == 0 && buf[4] == big[4099],
+		   "restored file is writable");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("sparse", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == sizeof(buf) &&
+		   ufs_lseek(fd2, 0, UFS_SEEK_END) == 100001, "sparse size");
+	bool is_ok = true;
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		is_ok = is_ok && buf[i] == 0;
+	unit_check(is_ok && ufs_pread(fd2, buf, 10, 100000) == 1 &&
+		   buf[0] == 'x', "restored sparse file");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("empty", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 0, "restored empty file");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_open("deleted", 0) == -1, "deleted file is not saved");
+	unit_check(ufs_pread(fd, buf, 3, 0) == 3 && memcmp(buf, "old", 3) == 0,
+		   "the replaced file lives while opened");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(deleted) != 0);
+
+	/* The image was not changed by the writes. */
+	unit_check(ufs_restore(path) == 0, "restore again");
+	fd2 = ufs_open("big", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == big_size &&
+		   memcmp(buf, big, big_size) == 0, "image is not changed");
+	/* Snapshot over the image the opened files are mapped from. */
+	unit_fail_if(ufs_pwrite(fd2, "new", 3, 0) != 3);
+	unit_check(ufs_snapshot(path) == 0, "snapshot over the image in use");
+	unit_check(ufs_pread(fd2, buf, big_size, 0) == big_size &&
+		   memcmp(buf, "new", 3) == 0 &&
+		   memcmp(buf + 3, big + 3, big_size - 3) == 0,
+		   "the old image still works");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_restore(path) == 0, "restore the new image");
+	fd2 = ufs_open("big", 0);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == big_size &&
+		   memcmp(buf, "new", 3) == 0 &&
+		   memcmp(buf + 3, big + 3, big_size - 3) == 0, "new image");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("sparse") != 0);
+	unit_fail_if(ufs_delete("empty") != 0);
+	unlink(path);
+
+	unit_check(ufs_restore(path) == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "no image");
+	FILE *f = fopen(path, "w");
+	fputs("not an image", f);
+	fclose(f);
+	unit_check(ufs_restore(path) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARGUMENT, "bad image");
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static void
+test_many_files(void)
+{
+	unit_test_start();
+	/*
+	 * Enough files for the name index to grow several times. Every
+	 * second one is deleted, some of them while still opened.
+	 */
+	enum { count = 1000 };
+	char name[32];
+	int fds[count];
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file_%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+		unit_fail_if(ufs_write(fds[i], name, strlen(name)) <= 0);
+		if (i % 4 != 0) {
+			unit_fail_if(ufs_close(fds[i]) != 0);
+			fds[i] = -1;
+		}
+	}
+	for (int i = 0; i < count; i += 2) {
+		snprintf(name, sizeof(name), "file_%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file_%d", i);
+		int fd = ufs_open(name, 0);
+		if (i % 2 == 0) {
+			is_ok = is_ok && fd == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+			continue;
+		}
+		char buf[32];
+		ssize_t rc = ufs_read(fd, buf, sizeof(buf));
+		is_ok = is_ok && rc == (ssize_t)strlen(name) &&
+			memcmp(buf, name, rc) == 0;
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_check(is_ok, "found the live files only");
+
+	int fd = ufs_open("file_0", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, name, sizeof(name)) == 0,
+		   "a new file with the name of a deleted one is empty");
+	unit_fail_if(ufs_close(fd) != 0);
+	for (int i = 0; i < count; ++i) {
+		if (fds[i] != -1)
+			unit_fail_if(ufs_close(fds[i]) != 0);
+		if (i % 2 != 0) {
+			snprintf(name, sizeof(name), "file_%d", i);
+			unit_fail_if(ufs_delete(name) != 0);
+		}
+	}
+	unit_fail_if(ufs_delete("file_0") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_fd_reuse(void)
+{
+	unit_test_start();
+	/*
+	 * The lowest free descriptor is always taken, also after the
+	 * table grows and shrinks.
+	 */
+	enum { count = 300 };
+	int fds[count];
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", UFS_CREATE);
+		is_ok = is_ok && fds[i] == i;
+	}
+	unit_check(is_ok, "descriptors go in order");
+	unit_fail_if(ufs_close(130) != 0);
+	unit_fail_if(ufs_close(5) != 0);
+	unit_fail_if(ufs_close(70) != 0);
+	unit_check(ufs_open("file", 0) == 5, "lowest is reused");
+	unit_check(ufs_open("file", 0) == 70, "next lowest");
+	unit_check(ufs_open("file", 0) == 130, "and the next one");
+	unit_check(ufs_open("file", 0) == count, "then a new one");
+	unit_fail_if(ufs_close(count) != 0);
+
+	for (int i = 1; i < count; ++i)
+		unit_fail_if(ufs_close(i) != 0);
+	unit_check(ufs_close(1) == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "closed descriptor is invalid");
+	for (int i = 1; i < count; ++i)
+		is_ok = is_ok && ufs_open("file", 0) == i;
+	unit_check(is_ok, "shrunk table grows in order again");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_close(i) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	enum { size = 5 * 4096 + 100 };
+	static char data[size], buf[size + 100];
+	for (int i = 0; i < size; ++i)
+		data[i] = i % 251;
+	int fd = ufs_open("orig", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_check(ufs_clone("orig", "copy") == 0, "clone");
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == size &&
+		   memcmp(buf, data, size) == 0, "clone has the same data");
+
+	/* Writes by both sides don't leak into the other one. */
+	unit_fail_if(ufs_pwrite(fd2, "copy", 4, 4096 + 10) != 4);
+	unit_fail_if(ufs_pwrite(fd, "orig", 4, 3 * 4096 + 10) != 4);
+	unit_fail_if(ufs_write(fd, "tail", 4) != 4);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == size + 4 &&
+		   memcmp(buf, data, 4096 + 10) == 0 &&
+		   memcmp(buf + 4096 + 10, data + 4096 + 10, 4) == 0 &&
+		   memcmp(buf + 3 * 4096 + 10, "orig", 4) == 0 &&
+		   memcmp(buf + size, "tail", 4) == 0, "source data");
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == size &&
+		   memcmp(buf + 4096 + 10, "copy", 4) == 0 &&
+		   memcmp(buf + 3 * 4096 + 10, data + 3 * 4096 + 10, 4) == 0,
+		   "clone data");
+
+	/* A cut zeroes the tail of the clone block only. */
+	unit_fail_if(ufs_resize(fd2, 2 * 4096 + 5) != 0);
+	unit_fail_if(ufs_resize(fd2, size) != 0);
+	bool is_ok = ufs_pread(fd2, buf, sizeof(buf), 0) == size &&
+		memcmp(buf + 2 * 4096, data + 2 * 4096, 5) == 0;
+	for (int i = 2 * 4096 + 5; i < size && is_ok; ++i)
+		is_ok = buf[i] == 0;
+	unit_check(is_ok, "cut clone");
+	unit_check(ufs_pread(fd, buf, 4096, 2 * 4096) == 4096 &&
+		   memcmp(buf, data + 2 * 4096, 4096) == 0, "source is not cut");
+
+	/* A clone of a clone outlives both. */
+	unit_check(ufs_clone("copy", "copy2") == 0, "clone of a clone");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("orig") != 0);
+	fd = ufs_open("copy2", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == size &&
+		   memcmp(buf, data, 4096 + 10) == 0 &&
+		   memcmp(buf + 4096 + 10, "copy", 4) == 0, "second clone data");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* The target is replaced. */
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("small", "copy2") == 0, "clone over a file");
+	fd = ufs_open("copy2", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "small", 5) == 0, "replaced target");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("none", "x") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "clone of no file");
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("copy2") != 0);
+
+	/* A write over several shared blocks copies all of them. */
+	fd = ufs_open("orig", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_clone("orig", "copy") != 0);
+	fd2 = ufs_open("copy", 0);
+	static char run[3 * 4096];
+	memset(run, 'r', sizeof(run));
+	unit_fail_if(ufs_pwrite(fd2, run, sizeof(run), 100) != sizeof(run));
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == size &&
+		   memcmp(buf, data, 100) == 0 &&
+		   memcmp(buf + 100, run, sizeof(run)) == 0 &&
+		   memcmp(buf + 100 + sizeof(run), data + 100 + sizeof(run),
+			  size - 100 - sizeof(run)) == 0, "clone run data");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == size &&
+		   memcmp(buf, data, size) == 0, "source of a run");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("orig") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("a/b") == 0, "mkdir nested");
+	unit_check(ufs_mkdir("/a//c/") == 0, "extra slashes are skipped");
+	unit_check(ufs_mkdir("a") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir of an existing dir");
+	unit_check(ufs_mkdir("x/y") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "mkdir without parent");
+	int fd = ufs_open("a/b/file", UFS_CREATE);
+	unit_check(fd != -1, "create in a dir");
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", UFS_CREATE);
+	unit_check(fd != -1, "same name in another dir");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	char buf[16];
+	fd = ufs_open("/a/b/file", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "data", 4) == 0, "open by path");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("a/b", 0) == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "open of a dir");
+	unit_check(ufs_open("a/d/file", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no dir on the path");
+	unit_check(ufs_open("file/x", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "file on the path");
+	unit_check(ufs_delete("a") == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "delete of a dir");
+
+	struct ufs_dir *dir = ufs_opendir("a");
+	unit_fail_if(dir == NULL);
+	int mask = 0;
+	const struct ufs_dirent *e;
+	while ((e = ufs_readdir(dir)) != NULL) {
+		if (strcmp(e->name, "b") == 0 && e->is_dir)
+			mask |= 1;
+		else if (strcmp(e->name, "c") == 0 && e->is_dir)
+			mask |= 2;
+		else
+			mask |= 4;
+	}
+	ufs_closedir(dir);
+	unit_check(mask == 3, "list a dir");
+	dir = ufs_opendir("/");
+	unit_fail_if(dir == NULL);
+	mask = 0;
+	while ((e = ufs_readdir(dir)) != NULL) {
+		if (strcmp(e->name, "a") == 0 && e->is_dir)
+			mask |= 1;
+		else if (strcmp(e->name, "file") == 0 && !e->is_dir)
+			mask |= 2;
+		else
+			mask |= 4;
+	}
+	ufs_closedir(dir);
+	unit_check(mask == 3, "list the root");
+	unit_check(ufs_opendir("file") == NULL &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "list a file");
+
+	/* The tree is saved and restored as is, the empty dir too. */
+	const char *path = "test_dirs.img";
+	unit_fail_if(ufs_snapshot(path) != 0);
+	unit_fail_if(ufs_delete("a/b/file") != 0);
+	unit_fail_if(ufs_rmdir("a/b") != 0);
+	unit_fail_if(ufs_rmdir("a/c") != 0);
+	unit_check(ufs_restore(path) == 0, "restore a tree");
+	unlink(path);
+	fd = ufs_open("a/b/file", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "data", 4) == 0, "restored file in a dir");
+	unit_fail_if(ufs_close(fd) != 0);
+	dir = ufs_opendir("a/c");
+	unit_check(dir != NULL && ufs_readdir(dir) == NULL, "restored empty dir");
+	ufs_closedir(dir);
+
+	unit_check(ufs_rmdir("a") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "rmdir of a not empty dir");
+	/* A deleted but opened file doesn't keep the dir. */
+	fd = ufs_open("a/b/file", 0);
+	unit_fail_if(ufs_delete("a/b/file") != 0);
+	unit_check(ufs_rmdir("a/b") == 0, "rmdir");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 4, "read after rmdir");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_rmdir("a/c") != 0);
+	unit_fail_if(ufs_rmdir("a") != 0);
+	unit_check(ufs_open("a/b/file", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "the tree is gone");
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_mmap_storage(void)
+{
+	unit_test_start();
+	/*
+	 * Files in both mmap storages, interleaved, with some of them
+	 * deleted in the middle so the freed blocks get reused.
+	 */
+	enum { count = 8, size = 300 * 1000 };
+	static char buf[size];
+	char name[16];
+	for (int round = 0; round < 2; ++round) {
+		ufs_set_storage(round == 0 ? UFS_STORAGE_MMAP :
+				UFS_STORAGE_MMAP_HUGE);
+		for (int i = 0; i < count; ++i) {
+			snprintf(name, sizeof(name), "file_%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			unit_fail_if(fd == -1);
+			memset(buf, 'a' + i, size);
+			unit_fail_if(ufs_write(fd, buf, size) != size);
+			unit_fail_if(ufs_close(fd) != 0);
+			if (i % 2 == 1) {
+				snprintf(name, sizeof(name), "file_%d", i - 1);
+				unit_fail_if(ufs_delete(name) != 0);
+			}
+		}
+		bool is_ok = true;
+		for (int i = 1; i < count; i += 2) {
+			snprintf(name, sizeof(name), "file_%d", i);
+			int fd = ufs_open(name, 0);
+			unit_fail_if(fd == -1);
+			is_ok = is_ok && ufs_read(fd, buf, size) == size;
+			for (int j = 0; j < size && is_ok; ++j)
+				is_ok = buf[j] == 'a' + i;
+			unit_fail_if(ufs_close(fd) != 0);
+			unit_fail_if(ufs_delete(name) != 0);
+		}
+		unit_check(is_ok, "data in the mmap storage is kept");
+	}
+	/*
+	 * Extents of a file are carved one after another from a region,
+	 * a view over them must pin each, not only the first one.
+	 */
+	ufs_set_storage(UFS_STORAGE_MMAP);
+	enum { view_size = 8 * 4096 };
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	memset(buf, 'v', view_size);
+	unit_fail_if(ufs_write(fd, buf, view_size) != view_size);
+	unit_fail_if(ufs_lseek(fd, 0, UFS_SEEK_SET) != 0);
+	struct ufs_iovec iov[8];
+	int cnt = 8;
+	struct ufs_pin *pin;
+	unit_fail_if(ufs_read_view(fd, view_size, iov, &cnt, &pin) != view_size);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	fd = ufs_open("other", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	memset(buf, 'o', view_size);
+	unit_fail_if(ufs_write(fd, buf, view_size) != view_size);
+	bool is_ok = true;
+	for (int i = 0; i < cnt; ++i) {
+		for (size_t j = 0; j < iov[i].iov_len; ++j)
+			is_ok = is_ok && ((char *)iov[i].iov_base)[j] == 'v';
+	}
+	unit_check(is_ok, "adjacent extents of a view are pinned");
+	ufs_pin_release(pin);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("other") != 0);
+	ufs_set_storage(UFS_STORAGE_HEAP);
+
+	unit_test_finish();
+}
+
+static void
+test_resize_zero_fill(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+	/*
+	 * Shrink into the middle of a block and grow back. The cut off
+	 * bytes should not come back.
+	 */
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buffer[10000];
+	memset(buffer, 'a', sizeof(buffer));
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+	unit_fail_if(ufs_resize(fd, 5000) != 0);
+	unit_fail_if(ufs_resize(fd, 20000) != 0);
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char big[30000];
+	ssize_t rc = ufs_read(fd2, big, sizeof(big));
+	unit_check(rc == 20000, "read the grown size");
+	bool is_ok = true;
+	for (int i = 0; i < 20000; ++i)
+		is_ok = is_ok && big[i] == (i < 5000 ? 'a' : 0);
+	unit_check(is_ok, "grown part is zeros");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	/* A read view keeps the data cut in the middle of a block. */
+	unit_fail_if(ufs_pwrite(fd, buffer, sizeof(buffer), 0) !=
+		     sizeof(buffer));
+	fd2 = ufs_open("file", 0);
+	struct ufs_iovec iov[4];
+	int cnt = 4;
+	struct ufs_pin *pin;
+	unit_fail_if(ufs_read_view(fd2, sizeof(buffer), iov, &cnt, &pin) !=
+		     sizeof(buffer));
+	unit_fail_if(ufs_resize(fd, 5000) != 0);
+	is_ok = true;
+	for (int i = 0; i < cnt; ++i) {
+		for (size_t j = 0; j < iov[i].iov_len; ++j)
+			is_ok = is_ok && ((char *)iov[i].iov_base)[j] == 'a';
+	}
+	unit_check(is_ok, "a view does not see the cut");
+	ufs_pin_release(pin);
+	unit_check(ufs_pread(fd2, big, sizeof(big), 0) == 5000, "cut size");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+#if UFS_THREAD_SAFE
+
+enum {
+	MT_THREADS = 8,
+	MT_ROUNDS = 200,
+	MT_SHARED_SIZE = 64 * 1024,
+};
+
+static void *
+thread_io_f(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[32], buf[256], check[256];
+	bool is_ok = true;
+	for (int i = 0; i < MT_ROUNDS && is_ok; ++i) {
+		/* Own file: create, write, read back, delete. */
+		snprintf(name, sizeof(name), "mt_%d", id);
+		memset(buf, 'a' + id, sizeof(buf));
+		int fd = ufs_open(name, UFS_CREATE);
+		is_ok = fd != -1 && ufs_write(fd, buf, sizeof(buf)) == sizeof(buf) &&
+			ufs_pread(fd, check, sizeof(check), 0) == sizeof(check) &&
+			memcmp(buf, check, sizeof(buf)) == 0 &&
+			ufs_close(fd) == 0 && ufs_delete(name) == 0;
+		/* The error code is per thread. */
+		is_ok = is_ok && ufs_open(name, 0) == -1 &&
+			ufs_errno() == UFS_ERR_NO_FILE;
+		/* The shared file is read in parallel. */
+		fd = ufs_open("shared", 0);
+		size_t offset = (id * 7919 + i * 131) % (MT_SHARED_SIZE - 256);
+		is_ok = is_ok && fd != -1 &&
+			ufs_pread(fd, check, sizeof(check), offset) == sizeof(check);
+		for (size_t j = 0; j < sizeof(check) && is_ok; ++j)
+			is_ok = check[j] == (char)((offset + j) % 251);
+		is_ok = is_ok && ufs_close(fd) == 0;
+		/* A clone of the shared file is changed, the file is not. */
+		snprintf(name, sizeof(name), "mt_clone_%d", id);
+		is_ok = is_ok && ufs_clone("shared", name) == 0;
+		fd = ufs_open(name, 0);
+		is_ok = is_ok && fd != -1 &&
+			ufs_pwrite(fd, buf, sizeof(buf), offset) == sizeof(buf) &&
+			ufs_close(fd) == 0 && ufs_delete(name) == 0;
+		/* Own directory in the shared one. */
+		snprintf(name, sizeof(name), "mt_dir/%d", id);
+		is_ok = is_ok && ufs_mkdir(name) == 0;
+		snprintf(name, sizeof(name), "mt_dir/%d/file", id);
+		fd = ufs_open(name, UFS_CREATE);
+		is_ok = is_ok && fd != -1 && ufs_close(fd) == 0 &&
+			ufs_delete(name) == 0;
+		struct ufs_dir *dir = ufs_opendir("mt_dir");
+		is_ok = is_ok && dir != NULL;
+		while (dir != NULL && ufs_readdir(dir) != NULL)
+			;
+		ufs_closedir(dir);
+		snprintf(name, sizeof(name), "mt_dir/%d", id);
+		is_ok = is_ok && ufs_rmdir(name) == 0;
+	}
+	return (void *)(intptr_t)is_ok;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	unit_fail_if(ufs_mkdir("mt_dir") != 0);
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	for (int i = 0; i < MT_SHARED_SIZE; ++i) {
+		char c = i % 251;
+		unit_fail_if(ufs_write(fd, &c, 1) != 1);
+	}
+	pthread_t threads[MT_THREADS];
+	for (int i = 0; i < MT_THREADS; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL, thread_io_f,
+					    (void *)(intptr_t)i) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < MT_THREADS; ++i) {
+		void *result;
+		pthread_join(threads[i], &result);
+		is_ok = is_ok && result != NULL;
+	}
+	unit_check(is_ok, "threads worked with own and shared files");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+	unit_check(ufs_rmdir("mt_dir") == 0, "shared dir is empty");
+
+	unit_test_finish();
+}
+
+#endif
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +1266,19 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_resize_zero_fill();
+	test_resize_sparse();
+	test_positional_io();
+	test_read_view();
+	test_snapshot();
+	test_many_files();
+	test_fd_reuse();
+	test_dirs();
+	test_clone();
+	test_mmap_storage();
+#if UFS_THREAD_SAFE
+	test_threads();
+#endif
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
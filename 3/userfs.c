@@ -1,114 +1,661 @@
 #include "userfs.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define FD_INIT_CAP 10
+#if UFS_THREAD_SAFE
+#include <pthread.h>
+#define UFS_TLS __thread
+typedef pthread_rwlock_t rwlock_t;
+#define RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+#define rwlock_init(l) pthread_rwlock_init(l, NULL)
+#define rwlock_destroy(l) pthread_rwlock_destroy(l)
+#define read_lock(l) pthread_rwlock_rdlock(l)
+#define write_lock(l) pthread_rwlock_wrlock(l)
+#define unlock(l) pthread_rwlock_unlock(l)
+#else
+#define UFS_TLS
+typedef int rwlock_t;
+#define RWLOCK_INITIALIZER 0
+#define rwlock_init(l) (void)(l)
+#define rwlock_destroy(l) (void)(l)
+#define read_lock(l) (void)(l)
+#define write_lock(l) (void)(l)
+#define unlock(l) (void)(l)
+#endif
+
+#define FD_INIT_CAP 64
 #define FD_GROW 2
+/* Shrink only a mostly empty table, so open/close churn doesn't realloc. */
+#define FD_SHRINK 4
 
 enum { BLOCK_SIZE = 4096, MAX_FILE_SIZE = 104857600 };
+/* An extent is never bigger than this many blocks. */
+enum { EXTENT_MAX_BLOCKS = 256 };
+
+static UFS_TLS enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/*
+ * Block storage in mmaped regions. A region is carved into runs of
+ * blocks for extents by first fit over a bitmap, skipping the full
+ * words of it. The scan starts at the region which has served the
+ * last allocation, and in a region at its first free block. An empty
+ * region is
+ * kept for reuse with MADV_FREE, so the kernel can take the memory
+ * back, the other empty ones are unmapped. Big runs freed inside a
+ * used region are dropped right away, a small file must not pin the
+ * whole region.
+ */
+#define REGION_SIZE (2 << 20)
+#define REGION_BLOCKS (REGION_SIZE / BLOCK_SIZE)
+#define REGION_DROP_BLOCKS 16
 
-struct block {
+struct region {
+    struct region *next;
     char *mem;
-    int used;
-    struct block *next, *prev;
+    uint64_t used[REGION_BLOCKS / 64];
+    int free_count;
+    /* No free blocks below it. */
+    int hint;
+};
+
+static enum ufs_storage storage = UFS_STORAGE_HEAP;
+static struct region *regions = NULL;
+static struct region *empty_region = NULL;
+/* The region of the last allocation, tried first. */
+static struct region *alloc_region = NULL;
+static rwlock_t regions_lock = RWLOCK_INITIALIZER;
+
+void ufs_set_storage(enum ufs_storage s) {
+    __atomic_store_n(&storage, s, __ATOMIC_RELAXED);
+}
+
+/* The first block from @a i used or free as @a used, REGION_BLOCKS if none. */
+static int region_next(const struct region *r, int i, int used) {
+    while (i < REGION_BLOCKS) {
+        uint64_t w = used ? r->used[i / 64] : ~r->used[i / 64];
+        w &= ~0ULL << (i % 64);
+        if (w) return i / 64 * 64 + __builtin_ctzll(w);
+        i = (i / 64 + 1) * 64;
+    }
+    return REGION_BLOCKS;
+}
+
+static void region_mark(struct region *r, int start, int count, int used) {
+    for (int i = start; i < start + count; i++) {
+        if (used) r->used[i / 64] |= 1ULL << (i % 64);
+        else r->used[i / 64] &= ~(1ULL << (i % 64));
+    }
+    r->free_count += used ? -count : count;
+    if (used && start == r->hint) r->hint = start + count;
+    else if (!used && start < r->hint) r->hint = start;
+}
+
+/* First fit of @a count free blocks, -1 if there is no such run. */
+static int region_find(const struct region *r, int count) {
+    if (r->free_count < count) return -1;
+    int start = region_next(r, r->hint, 0);
+    while (start + count <= REGION_BLOCKS) {
+        int end = region_next(r, start, 1);
+        if (end - start >= count) return start;
+        start = region_next(r, end, 0);
+    }
+    return -1;
+}
+
+static struct region *region_new(int huge) {
+    struct region *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    /* Huge pages need the region aligned by its size. */
+    size_t size = huge ? 2 * REGION_SIZE : REGION_SIZE;
+    char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) { free(r); return NULL; }
+    if (huge) {
+        char *aligned = (char *)(((uintptr_t)mem + REGION_SIZE - 1) & ~(uintptr_t)(REGION_SIZE - 1));
+        if (aligned > mem) munmap(mem, aligned - mem);
+        munmap(aligned + REGION_SIZE, mem + size - aligned - REGION_SIZE);
+        mem = aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(mem, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+    r->mem = mem;
+    r->free_count = REGION_BLOCKS;
+    return r;
+}
+
+static char *region_alloc(int count, int huge, struct region **out) {
+    write_lock(&regions_lock);
+    struct region *r = alloc_region;
+    int start = r ? region_find(r, count) : -1;
+    if (start < 0) {
+        for (r = regions; r; r = r->next)
+            if (r != alloc_region && (start = region_find(r, count)) >= 0) break;
+    }
+    if (!r && (r = region_new(huge))) {
+        r->next = regions;
+        regions = r;
+        start = 0;
+    }
+    char *mem = NULL;
+    if (r) {
+        if (r == empty_region) empty_region = NULL;
+        region_mark(r, start, count, 1);
+        alloc_region = r;
+        mem = r->mem + (size_t)start * BLOCK_SIZE;
+    }
+    unlock(&regions_lock);
+    *out = r;
+    return mem;
+}
+
+static void region_free(struct region *r, char *mem, int count) {
+    write_lock(&regions_lock);
+    region_mark(r, (mem - r->mem) / BLOCK_SIZE, count, 0);
+    if (r->free_count == REGION_BLOCKS) {
+        if (!empty_region) {
+#ifdef MADV_FREE
+            if (madvise(r->mem, REGION_SIZE, MADV_FREE) != 0)
+#endif
+                madvise(r->mem, REGION_SIZE, MADV_DONTNEED);
+            empty_region = r;
+        } else {
+            struct region **p = &regions;
+            while (*p != r) p = &(*p)->next;
+            *p = r->next;
+            if (alloc_region == r) alloc_region = NULL;
+            munmap(r->mem, REGION_SIZE);
+            free(r);
+        }
+    } else if (count >= REGION_DROP_BLOCKS) {
+        madvise(mem, (size_t)count * BLOCK_SIZE, MADV_DONTNEED);
+    }
+    unlock(&regions_lock);
+}
+
+/* A restored snapshot, mapped while any its extent is alive. */
+struct image {
+    void *addr;
+    size_t size;
+    int refs;
+};
+
+/*
+ * One allocation for blocks [first, first + count) of a file. Blocks
+ * past the file end are spare and given out to the next appends.
+ */
+struct extent {
+    struct extent *next;
+    int first, count;
+    /* The file holds one reference, each read view pin one more. */
+    int refs;
+    /*
+     * Files using the blocks. The blocks of a clone are views of the
+     * source extents: they own no memory and point to the base one.
+     * A shared block is copied on write.
+     */
+    int shares;
+    struct extent *base;
+    /* Where the blocks are: in a mapped image, a region, or in data. */
+    struct image *image;
+    struct region *region;
+    char *mem;
+    char data[];
+};
+
+struct ufs_pin {
+    int count;
+    struct extent *extents[];
 };
 
+/* Holes are given to read views as this block. */
+static const char zero_block[BLOCK_SIZE];
+
+static void image_unref(struct image *img) {
+    if (__atomic_sub_fetch(&img->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    munmap(img->addr, img->size);
+    free(img);
+}
+
+static struct extent *extent_base(struct extent *e) {
+    return e->base ? e->base : e;
+}
+
+static int extent_shared(struct extent *e) {
+    return __atomic_load_n(&extent_base(e)->shares, __ATOMIC_ACQUIRE) > 1;
+}
+
+static int extent_has(const struct extent *e, int idx, const char *mem) {
+    return idx >= e->first && idx < e->first + e->count &&
+           mem == e->mem + (size_t)(idx - e->first) * BLOCK_SIZE;
+}
+
+static void extent_unref(struct extent *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (e->base) extent_unref(e->base);
+    if (e->image) image_unref(e->image);
+    if (e->region) region_free(e->region, e->mem, e->count);
+    free(e);
+}
+
+/* The file lets the extent go, pins can still hold it. */
+static void extent_drop(struct extent *e) {
+    __atomic_sub_fetch(&extent_base(e)->shares, 1, __ATOMIC_ACQ_REL);
+    extent_unref(e);
+}
+
 struct file {
-    struct block *first, *last;
+    /*
+     * Block table, block i holds bytes [i * BLOCK_SIZE, (i + 1) * BLOCK_SIZE).
+     * NULL is a hole which reads as zeros.
+     */
+    char **blocks;
+    int block_count, block_cap;
+    /*
+     * Sorted by first block, the last one goes first. Copies of the
+     * shared blocks can overlap the shared extents.
+     */
+    struct extent *extents;
+    int extent_blocks;
+    /* Set once the blocks are shared with a clone, writes check it. */
+    int cloned;
+    size_t size;
     int refs;
+    /* The last path component, the entry is found by it and parent. */
     char *name;
+    unsigned hash;
+    struct file *parent;
     struct file *next, *prev;
+    /* Chain in the name index bucket. */
+    struct file *hnext;
+    /* Chain in the parent entries, under the parent lock. */
+    struct file *dnext, *dprev;
+    /* Entries of a directory, a directory has no data. */
+    struct file *children;
+    int is_dir;
+    /* refs and deleted are protected by the index shard lock. */
     int deleted;
+    /*
+     * Readers of the data and the size share it, writers own it. In
+     * a directory it protects the entry list.
+     */
+    rwlock_t lock;
 };
 
 static struct file *all_files = NULL;
+static rwlock_t files_lock = RWLOCK_INITIALIZER;
+/* The root is not in the index and is never removed. */
+static struct file root = {.is_dir = 1, .lock = RWLOCK_INITIALIZER};
+
+/*
+ * Name index: chained hash tables over the not deleted entries, keyed
+ * by the parent directory and the name in it. So each directory has
+ * its own index, just spread over the shared tables. Each table is
+ * grown twice when its entries outnumber the buckets. An entry goes
+ * to the shard by the low bits of its hash, so opens of different
+ * files mostly take different locks.
+ */
+#define INDEX_INIT_CAP 64
+#define INDEX_SHARDS 16
+
+struct index_shard {
+    struct file **buckets;
+    unsigned cap, count;
+    rwlock_t lock;
+};
+
+static struct index_shard shards[INDEX_SHARDS] = {
+    [0 ... INDEX_SHARDS - 1] = {.lock = RWLOCK_INITIALIZER},
+};
 
 struct filedesc {
     struct file *file;
-    int block_num, offset;
+    size_t pos;
     enum open_flags flags;
 };
 
+/*
+ * A descriptor itself is not locked: it must not be used from several
+ * threads at once. The table is, and the lock is held only to find a
+ * descriptor, so the IO doesn't wait for opens and closes.
+ */
 static struct filedesc **fds = NULL;
 static int fds_count = 0, fds_cap = 0;
+static rwlock_t fds_lock = RWLOCK_INITIALIZER;
+/*
+ * Free descriptor search. Bit i of fd_busy is set when descriptor i
+ * is taken, bit i of fd_full - when word i of fd_busy is all ones.
+ * The capacity is a multiple of 64.
+ */
+static uint64_t *fd_busy = NULL, *fd_full = NULL;
 
 enum ufs_error_code ufs_errno() { return ufs_error_code; }
 
-static enum ufs_error_code init_fds() {
-    fds = calloc(FD_INIT_CAP, sizeof(*fds));
-    if (!fds) return UFS_ERR_NO_MEM;
-    fds_cap = FD_INIT_CAP;
-    return UFS_ERR_NO_ERR;
-}
-
-static enum ufs_error_code resize_fds() {
-    int new_cap = fds_cap;
-    if (fds_count == fds_cap) new_cap *= FD_GROW;
-    else if (fds_count * FD_GROW < fds_cap && fds_cap > FD_INIT_CAP)
-        new_cap /= FD_GROW;
-
-    if (new_cap == fds_cap) return UFS_ERR_NO_ERR;
+static enum ufs_error_code resize_fds(int new_cap) {
     struct filedesc **tmp = realloc(fds, sizeof(*fds) * new_cap);
     if (!tmp) return UFS_ERR_NO_MEM;
-    memset(tmp + fds_count, 0, (new_cap - fds_count) * sizeof(*fds));
     fds = tmp;
+    if (new_cap < fds_cap) { fds_cap = new_cap; return UFS_ERR_NO_ERR; }
+
+    /* The bitmaps are tiny and are never shrunk. */
+    int words = fds_cap / 64, new_words = new_cap / 64;
+    int full_words = (words + 63) / 64, new_full_words = (new_words + 63) / 64;
+    uint64_t *busy = realloc(fd_busy, sizeof(*busy) * new_words);
+    if (!busy) return UFS_ERR_NO_MEM;
+    fd_busy = busy;
+    uint64_t *full = realloc(fd_full, sizeof(*full) * new_full_words);
+    if (!full) return UFS_ERR_NO_MEM;
+    fd_full = full;
+    memset(fds + fds_cap, 0, (new_cap - fds_cap) * sizeof(*fds));
+    memset(fd_busy + words, 0, (new_words - words) * sizeof(*fd_busy));
+    memset(fd_full + full_words, 0, (new_full_words - full_words) * sizeof(*fd_full));
     fds_cap = new_cap;
     return UFS_ERR_NO_ERR;
 }
 
-static enum ufs_error_code add_block(struct file *f) {
-    struct block *b = calloc(1, sizeof(*b));
-    if (!b) return UFS_ERR_NO_MEM;
-    b->mem = calloc(BLOCK_SIZE, 1);
-    if (!b->mem) { free(b); return UFS_ERR_NO_MEM; }
-    if (!f->first)
-        f->first = f->last = b;
-    else {
-        f->last->next = b;
-        b->prev = f->last;
-        f->last = b;
+static void fd_take(int fd) {
+    int w = fd / 64;
+    fd_busy[w] |= 1ULL << (fd % 64);
+    if (fd_busy[w] == UINT64_MAX) fd_full[w / 64] |= 1ULL << (w % 64);
+}
+
+static void fd_release(int fd) {
+    int w = fd / 64;
+    fd_busy[w] &= ~(1ULL << (fd % 64));
+    fd_full[w / 64] &= ~(1ULL << (w % 64));
+}
+
+/* Make the table @a count blocks long, new blocks are holes. */
+static enum ufs_error_code table_grow(struct file *f, int count) {
+    if (count <= f->block_count) return UFS_ERR_NO_ERR;
+    if (count > f->block_cap) {
+        int new_cap = f->block_cap ? f->block_cap : 1;
+        while (new_cap < count) new_cap *= 2;
+        char **tmp = realloc(f->blocks, sizeof(*tmp) * new_cap);
+        if (!tmp) return UFS_ERR_NO_MEM;
+        f->blocks = tmp;
+        f->block_cap = new_cap;
     }
+    memset(f->blocks + f->block_count, 0, (count - f->block_count) * sizeof(*f->blocks));
+    f->block_count = count;
     return UFS_ERR_NO_ERR;
 }
 
-static void free_blocks(struct block *b) {
-    while (b) {
-        struct block *next = b->next;
-        free(b->mem);
-        free(b);
-        b = next;
+/*
+ * Give memory to the hole @a idx. Zeros are not written, the caller
+ * fills the block. An extent covering the hole is reused unless it
+ * is shared or is @a avoid, otherwise a new one is made as big as the file has so
+ * far, but not bigger than @a want and the gap till the next extent.
+ * Returns the extent given to the block.
+ */
+static struct extent *extent_alloc(struct file *f, int idx, int want,
+                                   const struct extent *avoid) {
+    struct extent **p = &f->extents, *upper = NULL;
+    while (*p && (*p)->first > idx) { upper = *p; p = &(*p)->next; }
+    struct extent *e = *p;
+    if (e && e != avoid && idx < e->first + e->count && !extent_shared(e)) {
+        f->blocks[idx] = e->mem + (size_t)(idx - e->first) * BLOCK_SIZE;
+        return e;
+    }
+
+    int count = f->extent_blocks;
+    if (count < 1) count = 1;
+    if (count > want) count = want;
+    if (count > EXTENT_MAX_BLOCKS) count = EXTENT_MAX_BLOCKS;
+    if (upper && count > upper->first - idx) count = upper->first - idx;
+    enum ufs_storage st = __atomic_load_n(&storage, __ATOMIC_RELAXED);
+    if (st == UFS_STORAGE_HEAP) {
+        e = malloc(sizeof(*e) + (size_t)count * BLOCK_SIZE);
+        if (!e) return NULL;
+        e->region = NULL;
+        e->mem = e->data;
+    } else {
+        e = malloc(sizeof(*e));
+        if (!e) return NULL;
+        e->mem = region_alloc(count, st == UFS_STORAGE_MMAP_HUGE, &e->region);
+        if (!e->mem) { free(e); return NULL; }
     }
+    e->first = idx;
+    e->count = count;
+    e->refs = 1;
+    e->shares = 1;
+    e->base = NULL;
+    e->image = NULL;
+    e->next = *p;
+    *p = e;
+    f->extent_blocks += count;
+    f->blocks[idx] = e->mem;
+    return e;
+}
+
+static char *block_alloc(struct file *f, int idx, int want) {
+    return extent_alloc(f, idx, want, NULL) ? f->blocks[idx] : NULL;
 }
 
-static struct file *create_file(const char *name) {
+/* The extent holding block @a idx, which is not a hole. */
+static struct extent *extent_of(struct file *f, int idx) {
+    struct extent *e = f->extents;
+    while (!extent_has(e, idx, f->blocks[idx])) e = e->next;
+    return e;
+}
+
+/*
+ * Memory of block @a idx, which is not a hole, to write in place. A
+ * block shared with a clone is copied first, together with the shared
+ * blocks after it up to @a want blocks, into one new extent. With
+ * @a copy_pinned so is a block a read view can see. @a e is set to
+ * the extent which now holds the block, writes into it need no copy.
+ * NULL when out of memory.
+ */
+static char *block_writable(struct file *f, int idx, int want, int copy_pinned,
+                            struct extent **e) {
+    char *old = f->blocks[idx];
+    struct extent *from = f->cloned || copy_pinned ? extent_of(f, idx) : NULL;
+    *e = from;
+    if (!from || !(extent_shared(from) ||
+                   (copy_pinned && __atomic_load_n(&from->refs, __ATOMIC_ACQUIRE) > 1)))
+        return old;
+    int run = 1;
+    while (run < want && idx + run < f->block_count &&
+           extent_has(from, idx + run, f->blocks[idx + run])) run++;
+    f->blocks[idx] = NULL;
+    struct extent *to = extent_alloc(f, idx, run, from);
+    if (!to) { f->blocks[idx] = old; return NULL; }
+    if (run > to->first + to->count - idx) run = to->first + to->count - idx;
+    memcpy(f->blocks[idx], old, BLOCK_SIZE);
+    for (int i = idx + 1; i < idx + run; i++) {
+        char *mem = to->mem + (size_t)(i - to->first) * BLOCK_SIZE;
+        memcpy(mem, f->blocks[i], BLOCK_SIZE);
+        f->blocks[i] = mem;
+    }
+    *e = to;
+    return f->blocks[idx];
+}
+
+/* Cut the file to @a count blocks, extents starting past it are freed. */
+static void free_blocks(struct file *f, int count) {
+    while (f->extents && f->extents->first >= count) {
+        struct extent *e = f->extents;
+        f->extents = e->next;
+        f->extent_blocks -= e->count;
+        extent_drop(e);
+    }
+    f->block_count = count;
+}
+
+static unsigned entry_hash(const struct file *dir, const char *name, size_t len) {
+    /* FNV-1a of the directory address and the name. */
+    unsigned h = 2166136261u;
+    uintptr_t d = (uintptr_t)dir;
+    for (size_t i = 0; i < sizeof(d); i++, d >>= 8) h = (h ^ (d & 0xff)) * 16777619u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+static struct index_shard *shard_of(unsigned hash) {
+    return &shards[hash % INDEX_SHARDS];
+}
+
+static struct file **index_bucket(struct index_shard *sh, unsigned hash) {
+    return &sh->buckets[(hash / INDEX_SHARDS) & (sh->cap - 1)];
+}
+
+static enum ufs_error_code index_grow(struct index_shard *sh) {
+    unsigned new_cap = sh->cap ? sh->cap * 2 : INDEX_INIT_CAP;
+    struct file **tmp = calloc(new_cap, sizeof(*tmp));
+    if (!tmp) return UFS_ERR_NO_MEM;
+    for (unsigned i = 0; i < sh->cap; i++) {
+        struct file *f = sh->buckets[i];
+        while (f) {
+            struct file *next = f->hnext;
+            struct file **bucket = &tmp[(f->hash / INDEX_SHARDS) & (new_cap - 1)];
+            f->hnext = *bucket;
+            *bucket = f;
+            f = next;
+        }
+    }
+    free(sh->buckets);
+    sh->buckets = tmp;
+    sh->cap = new_cap;
+    return UFS_ERR_NO_ERR;
+}
+
+/* Index functions are called with the shard lock taken. */
+static enum ufs_error_code index_add(struct file *f) {
+    struct index_shard *sh = shard_of(f->hash);
+    if (sh->count >= sh->cap && index_grow(sh) != UFS_ERR_NO_ERR)
+        return UFS_ERR_NO_MEM;
+    struct file **bucket = index_bucket(sh, f->hash);
+    f->hnext = *bucket;
+    *bucket = f;
+    sh->count++;
+    return UFS_ERR_NO_ERR;
+}
+
+static void index_del(struct file *f) {
+    struct index_shard *sh = shard_of(f->hash);
+    struct file **p = index_bucket(sh, f->hash);
+    while (*p != f) p = &(*p)->hnext;
+    *p = f->hnext;
+    sh->count--;
+}
+
+/* Called with the shard lock and a reference to @a dir taken. */
+static struct file *create_file(struct file *dir, const char *name, size_t len,
+                                unsigned hash, int is_dir) {
     struct file *f = calloc(1, sizeof(*f));
     if (!f) return NULL;
-    f->name = strdup(name);
+    f->name = strndup(name, len);
     if (!f->name) { free(f); return NULL; }
-    if (add_block(f) != UFS_ERR_NO_ERR) { free(f->name); free(f); return NULL; }
+    f->hash = hash;
+    f->parent = dir;
+    f->is_dir = is_dir;
+    if (index_add(f) != UFS_ERR_NO_ERR) { free(f->name); free(f); return NULL; }
+    rwlock_init(&f->lock);
+    write_lock(&dir->lock);
+    if (dir->children) { f->dnext = dir->children; dir->children->dprev = f; }
+    dir->children = f;
+    unlock(&dir->lock);
+    write_lock(&files_lock);
     if (all_files) { f->next = all_files; all_files->prev = f; }
     all_files = f;
+    unlock(&files_lock);
     return f;
 }
 
+/* Take the entry out of the index and the directory, it can't be found. */
+static void unlink_file(struct file *f) {
+    index_del(f);
+    struct file *dir = f->parent;
+    write_lock(&dir->lock);
+    if (f->dprev) f->dprev->dnext = f->dnext;
+    if (f->dnext) f->dnext->dprev = f->dprev;
+    if (f == dir->children) dir->children = f->dnext;
+    unlock(&dir->lock);
+    f->deleted = 1;
+}
+
 static void remove_file(struct file *f) {
+    if (!f->deleted) unlink_file(f);
+    write_lock(&files_lock);
     if (f->prev) f->prev->next = f->next;
     if (f->next) f->next->prev = f->prev;
     if (f == all_files) all_files = f->next;
-    free_blocks(f->first);
+    unlock(&files_lock);
+    rwlock_destroy(&f->lock);
+    free_blocks(f, 0);
+    free(f->blocks);
     free(f->name);
     free(f);
 }
 
-static struct file *find_file(const char *name) {
-    for (struct file *f = all_files; f; f = f->next)
-        if (!strcmp(f->name, name) && !f->deleted)
+/* Deleted files are not in the index, so they can't be found. */
+static struct file *find_file(const struct file *dir, const char *name, size_t len,
+                              unsigned hash) {
+    struct index_shard *sh = shard_of(hash);
+    if (!sh->cap) return NULL;
+    for (struct file *f = *index_bucket(sh, hash); f; f = f->hnext)
+        if (f->hash == hash && f->parent == dir && !strncmp(f->name, name, len) &&
+            !f->name[len])
             return f;
     return NULL;
 }
 
+/*
+ * Find the directory @a name in @a dir and take a reference to it,
+ * so it is not removed while used. With @a make it is created when
+ * there is none.
+ */
+static struct file *dir_get(struct file *dir, const char *name, size_t len, int make,
+                            enum ufs_error_code *err) {
+    unsigned hash = entry_hash(dir, name, len);
+    struct index_shard *sh = shard_of(hash);
+    write_lock(&sh->lock);
+    struct file *d = find_file(dir, name, len, hash);
+    if (!d && make && !(d = create_file(dir, name, len, hash, 1))) *err = UFS_ERR_NO_MEM;
+    else if (!d) *err = UFS_ERR_NO_FILE;
+    else if (!d->is_dir) { *err = UFS_ERR_NOT_DIR; d = NULL; }
+    else d->refs++;
+    unlock(&sh->lock);
+    return d;
+}
+
+static void dir_put(struct file *dir) {
+    if (dir == &root) return;
+    struct index_shard *sh = shard_of(dir->hash);
+    write_lock(&sh->lock);
+    dir->refs--;
+    unlock(&sh->lock);
+}
+
+/*
+ * Find the directory of the last component of @a path, referenced,
+ * and the component. The components are separated by '/', the
+ * empty ones are skipped. The walk holds each directory until the
+ * next one is found. With @a make the missing directories are created.
+ */
+static struct file *walk(const char *path, int make, const char **name, size_t *len,
+                         enum ufs_error_code *err) {
+    struct file *dir = &root;
+    while (*path == '/') path++;
+    for (;;) {
+        size_t n = strcspn(path, "/");
+        const char *next = path + n;
+        while (*next == '/') next++;
+        if (!*next) { *name = path; *len = n; return dir; }
+        struct file *sub = dir_get(dir, path, n, make, err);
+        dir_put(dir);
+        if (!sub) return NULL;
+        dir = sub;
+        path = next;
+    }
+}
+
 static struct filedesc *new_fd(struct file *f, enum open_flags flags) {
     struct filedesc *d = calloc(1, sizeof(*d));
     if (!d) return NULL;
@@ -117,17 +664,38 @@ static struct filedesc *new_fd(struct file *f, enum open_flags flags) {
     return d;
 }
 
+/* The lowest free descriptor, 64 * 64 of them are checked per step. */
 static int get_fd_slot() {
-    if (!fds) return -1;
-    for (int i = 0; i < fds_cap; i++)
-        if (!fds[i]) return i;
-    if (resize_fds() != UFS_ERR_NO_ERR) return -1;
-    return fds_cap / FD_GROW;
+    int words = fds_cap / 64;
+    for (int i = 0; i * 64 < words; i++) {
+        if (fd_full[i] == UINT64_MAX) continue;
+        int w = i * 64 + __builtin_ctzll(~fd_full[i]);
+        if (w >= words) break;
+        return w * 64 + __builtin_ctzll(~fd_busy[w]);
+    }
+    int slot = fds_cap;
+    if (resize_fds(fds_cap ? fds_cap * FD_GROW : FD_INIT_CAP) != UFS_ERR_NO_ERR) return -1;
+    return slot;
+}
+
+static int fd_is_busy(int fd) {
+    return (fd_busy[fd / 64] >> (fd % 64)) & 1;
+}
+
+/* Called with the table locked for write. */
+static void fd_free_slot(int fd) {
+    fds[fd] = NULL;
+    fd_release(fd);
+    if (fd == fds_count - 1) while (fds_count > 0 && !fd_is_busy(fds_count - 1)) fds_count--;
+    if (fds_count * FD_SHRINK < fds_cap && fds_cap > FD_INIT_CAP)
+        resize_fds(fds_cap / FD_GROW);
 }
 
 static struct filedesc *fd_lookup(int fd) {
-    if (fd < 0 || fd >= fds_count) return NULL;
-    return fds[fd];
+    read_lock(&fds_lock);
+    struct filedesc *d = fd >= 0 && fd < fds_count ? fds[fd] : NULL;
+    unlock(&fds_lock);
+    return d;
 }
 
 static int writable(struct filedesc *d) {
@@ -138,149 +706,799 @@ static int readable(struct filedesc *d) {
     return d->flags == 0 || (d->flags & (UFS_CREATE | UFS_READ_ONLY | UFS_READ_WRITE));
 }
 
-int ufs_open(const char *name, int flags) {
-    if (!fds && init_fds() != UFS_ERR_NO_ERR) return -1;
-    struct file *f = find_file(name);
-    if (!f) {
-        if (!(flags & UFS_CREATE)) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
-        f = create_file(name);
-        if (!f) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
-    }
-    int slot = get_fd_slot();
-    if (slot == -1) return -1;
-    struct filedesc *desc = new_fd(f, flags);
+/* Find the file by @a path, or create with UFS_CREATE, and reference it. */
+static struct file *file_get(const char *path, int flags, enum ufs_error_code *err) {
+    size_t len;
+    struct file *dir = walk(path, 0, &path, &len, err), *f = NULL;
+    if (!dir) return NULL;
+    unsigned hash = entry_hash(dir, path, len);
+    struct index_shard *sh = shard_of(hash);
+    write_lock(&sh->lock);
+    f = find_file(dir, path, len, hash);
+    if (!len || (f && f->is_dir)) *err = UFS_ERR_IS_DIR;
+    else if (!f && !(flags & UFS_CREATE)) *err = UFS_ERR_NO_FILE;
+    else if (!f && !(f = create_file(dir, path, len, hash, 0))) *err = UFS_ERR_NO_MEM;
+    else f->refs++;
+    unlock(&sh->lock);
+    dir_put(dir);
+    return *err == UFS_ERR_NO_ERR ? f : NULL;
+}
+
+/* A deleted file lives until the last reference is gone. */
+static void file_put(struct file *f) {
+    struct index_shard *sh = shard_of(f->hash);
+    write_lock(&sh->lock);
+    if (--f->refs == 0 && f->deleted) remove_file(f);
+    unlock(&sh->lock);
+}
+
+int ufs_open(const char *path, int flags) {
+    struct filedesc *desc = new_fd(NULL, flags);
     if (!desc) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
-    f->refs++;
-    fds[slot] = desc;
-    if (slot == fds_count) fds_count++;
-    ufs_error_code = UFS_ERR_NO_ERR;
+    /* Reserve the slot, so the table is not locked during the lookup. */
+    write_lock(&fds_lock);
+    int slot = get_fd_slot();
+    if (slot != -1) {
+        fd_take(slot);
+        if (slot >= fds_count) fds_count = slot + 1;
+    }
+    unlock(&fds_lock);
+    if (slot == -1) { free(desc); ufs_error_code = UFS_ERR_NO_MEM; return -1; }
+
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    struct file *f = file_get(path, flags, &err);
+
+    write_lock(&fds_lock);
+    if (err == UFS_ERR_NO_ERR) { desc->file = f; fds[slot] = desc; }
+    else fd_free_slot(slot);
+    unlock(&fds_lock);
+    ufs_error_code = err;
+    if (err != UFS_ERR_NO_ERR) { free(desc); return -1; }
     return slot;
 }
 
-ssize_t ufs_write(int fd, const char *buf, size_t sz) {
-    struct filedesc *desc = fd_lookup(fd);
-    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
-    if (!writable(desc)) { ufs_error_code = UFS_ERR_NO_PERMISSION; return -1; }
-    struct file *f = desc->file;
-    struct block *blk = f->first;
-    for (int i = 0; i < desc->block_num; i++) blk = blk->next;
-    size_t total = blk->used + desc->block_num * BLOCK_SIZE;
-    if (total + sz > MAX_FILE_SIZE) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
-    ssize_t written = 0;
-
-    while (written < (ssize_t)sz) {
-        if (desc->offset == BLOCK_SIZE) {
-            blk = blk->next;
-            if (!blk) {
-                if (add_block(f) != UFS_ERR_NO_ERR) return written;
-                blk = f->last;
-            }
-            desc->offset = 0;
-            desc->block_num++;
-        }
-        size_t left = BLOCK_SIZE - desc->offset;
+/* Write at @a pos. Less than @a sz is written only when out of memory. */
+static size_t file_write(struct file *f, size_t pos, const char *buf, size_t sz) {
+    size_t written = 0;
+    /* The last extent found not shared, its blocks are written in place. */
+    struct extent *own = NULL;
+    while (written < sz) {
+        int idx = pos / BLOCK_SIZE;
+        size_t offset = pos % BLOCK_SIZE;
+        size_t left = BLOCK_SIZE - offset;
         if (sz - written < left) left = sz - written;
-        memcpy(blk->mem + desc->offset, buf + written, left);
-        desc->offset += left;
+        if (idx >= f->block_count && table_grow(f, idx + 1) != UFS_ERR_NO_ERR) break;
+        char *mem = f->blocks[idx];
+        if (!mem) {
+            if (!(mem = block_alloc(f, idx, EXTENT_MAX_BLOCKS))) break;
+            /* Zero only what the write does not cover. */
+            memset(mem, 0, offset);
+            memset(mem + offset + left, 0, BLOCK_SIZE - offset - left);
+        } else if (f->cloned && !(own && extent_has(own, idx, mem))) {
+            /* Copies of the shared blocks take only what is written. */
+            int want = (pos + sz - written + BLOCK_SIZE - 1) / BLOCK_SIZE - idx;
+            if (!(mem = block_writable(f, idx, want, 0, &own))) break;
+        }
+        memcpy(mem + offset, buf + written, left);
+        pos += left;
         written += left;
-        if (desc->offset > blk->used) blk->used = desc->offset;
+        if (pos > f->size) f->size = pos;
     }
-    ufs_error_code = UFS_ERR_NO_ERR;
     return written;
 }
 
-ssize_t ufs_read(int fd, char *buf, size_t sz) {
-    struct filedesc *desc = fd_lookup(fd);
-    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
-    if (!readable(desc)) { ufs_error_code = UFS_ERR_NO_PERMISSION; return -1; }
-    struct block *blk = desc->file->first;
-    for (int i = 0; i < desc->block_num; i++) blk = blk->next;
-    ssize_t total_read = 0;
-
-    while (total_read < (ssize_t)sz) {
-        if (desc->offset == BLOCK_SIZE) {
-            blk = blk->next;
-            if (!blk) return total_read;
-            desc->offset = 0;
-            desc->block_num++;
-        }
-        size_t avail = blk->used - desc->offset;
+static size_t file_read(struct file *f, size_t pos, char *buf, size_t sz) {
+    if (pos >= f->size) return 0;
+    if (f->size - pos < sz) sz = f->size - pos;
+    size_t total_read = 0;
+    while (total_read < sz) {
+        int idx = pos / BLOCK_SIZE;
+        size_t offset = pos % BLOCK_SIZE;
+        size_t avail = BLOCK_SIZE - offset;
         if (sz - total_read < avail) avail = sz - total_read;
-        if (!avail) return total_read;
-        memcpy(buf + total_read, blk->mem + desc->offset, avail);
-        desc->offset += avail;
+        if (f->blocks[idx]) memcpy(buf + total_read, f->blocks[idx] + offset, avail);
+        else memset(buf + total_read, 0, avail);
+        pos += avail;
         total_read += avail;
     }
     return total_read;
 }
 
-int ufs_close(int fd) {
+static struct filedesc *fd_for_write(int fd) {
     struct filedesc *desc = fd_lookup(fd);
-    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
+    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return NULL; }
+    if (!writable(desc)) { ufs_error_code = UFS_ERR_NO_PERMISSION; return NULL; }
+    return desc;
+}
+
+static struct filedesc *fd_for_read(int fd) {
+    struct filedesc *desc = fd_lookup(fd);
+    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return NULL; }
+    if (!readable(desc)) { ufs_error_code = UFS_ERR_NO_PERMISSION; return NULL; }
+    return desc;
+}
+
+static ssize_t write_result(size_t written, size_t sz) {
+    if (written < sz) ufs_error_code = UFS_ERR_NO_MEM;
+    else ufs_error_code = UFS_ERR_NO_ERR;
+    return written || !sz ? (ssize_t)written : -1;
+}
+
+ssize_t ufs_write(int fd, const char *buf, size_t sz) {
+    struct filedesc *desc = fd_for_write(fd);
+    if (!desc) return -1;
+    struct file *f = desc->file;
+    write_lock(&f->lock);
+    ssize_t rc = -1;
+    if (desc->pos + sz > MAX_FILE_SIZE) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+    } else {
+        size_t written = file_write(f, desc->pos, buf, sz);
+        desc->pos += written;
+        rc = write_result(written, sz);
+    }
+    unlock(&f->lock);
+    return rc;
+}
+
+ssize_t ufs_read(int fd, char *buf, size_t sz) {
+    struct filedesc *desc = fd_for_read(fd);
+    if (!desc) return -1;
+    read_lock(&desc->file->lock);
+    size_t total_read = file_read(desc->file, desc->pos, buf, sz);
+    desc->pos += total_read;
+    unlock(&desc->file->lock);
+    return total_read;
+}
+
+ssize_t ufs_pwrite(int fd, const char *buf, size_t sz, size_t offset) {
+    struct filedesc *desc = fd_for_write(fd);
+    if (!desc) return -1;
+    if (offset > MAX_FILE_SIZE || sz > MAX_FILE_SIZE - offset) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    write_lock(&desc->file->lock);
+    size_t written = file_write(desc->file, offset, buf, sz);
+    unlock(&desc->file->lock);
+    return write_result(written, sz);
+}
+
+ssize_t ufs_pread(int fd, char *buf, size_t sz, size_t offset) {
+    struct filedesc *desc = fd_for_read(fd);
+    if (!desc) return -1;
+    read_lock(&desc->file->lock);
+    size_t total_read = file_read(desc->file, offset, buf, sz);
+    unlock(&desc->file->lock);
+    return total_read;
+}
+
+static ssize_t iov_total(const struct ufs_iovec *iov, int iovcnt) {
+    if (iovcnt < 0 || (iovcnt > 0 && !iov)) { ufs_error_code = UFS_ERR_INVALID_ARGUMENT; return -1; }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > MAX_FILE_SIZE - total) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+ssize_t ufs_writev(int fd, const struct ufs_iovec *iov, int iovcnt) {
+    struct filedesc *desc = fd_for_write(fd);
+    if (!desc) return -1;
+    ssize_t total = iov_total(iov, iovcnt);
+    if (total < 0) return -1;
+    struct file *f = desc->file;
+    write_lock(&f->lock);
+    ssize_t rc = -1;
+    if (desc->pos + total > MAX_FILE_SIZE) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+    } else {
+        size_t written = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            size_t n = file_write(f, desc->pos, iov[i].iov_base, iov[i].iov_len);
+            desc->pos += n;
+            written += n;
+            if (n < iov[i].iov_len) break;
+        }
+        rc = write_result(written, total);
+    }
+    unlock(&f->lock);
+    return rc;
+}
+
+ssize_t ufs_readv(int fd, const struct ufs_iovec *iov, int iovcnt) {
+    struct filedesc *desc = fd_for_read(fd);
+    if (!desc) return -1;
+    if (iov_total(iov, iovcnt) < 0) return -1;
+    struct file *f = desc->file;
+    read_lock(&f->lock);
+    size_t total_read = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t n = file_read(f, desc->pos, iov[i].iov_base, iov[i].iov_len);
+        desc->pos += n;
+        total_read += n;
+        if (n < iov[i].iov_len) break;
+    }
+    unlock(&f->lock);
+    return total_read;
+}
+
+ssize_t ufs_read_view(int fd, size_t sz, struct ufs_iovec *iov, int *iovcnt,
+                      struct ufs_pin **pin) {
+    struct filedesc *desc = fd_for_read(fd);
+    if (!desc) return -1;
+    if (!iov || !iovcnt || *iovcnt <= 0 || !pin) { ufs_error_code = UFS_ERR_INVALID_ARGUMENT; return -1; }
+    struct ufs_pin *p = malloc(sizeof(*p) + sizeof(p->extents[0]) * *iovcnt);
+    if (!p) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
+    p->count = 0;
+
     struct file *f = desc->file;
-    f->refs--;
-    if (f->deleted && f->refs == 0) remove_file(f);
+    read_lock(&f->lock);
+    size_t start = desc->pos, pos = start;
+    if (pos >= f->size) sz = 0;
+    else if (f->size - pos < sz) sz = f->size - pos;
+    size_t end = pos + sz;
+    int cnt = 0;
+    struct extent *e = NULL;
+    while (pos < end) {
+        int idx = pos / BLOCK_SIZE;
+        size_t offset = pos % BLOCK_SIZE;
+        size_t len = BLOCK_SIZE - offset;
+        if (end - pos < len) len = end - pos;
+        const char *mem = f->blocks[idx];
+        if (mem && (!e || !extent_has(e, idx, mem)))
+            e = extent_of(f, idx);
+        /*
+         * Blocks of one extent lie one after another, glue them. The
+         * next extent can lie right after in a region too, it gets its
+         * own iovec to be pinned.
+         */
+        if (mem && cnt > 0 && p->count > 0 && p->extents[p->count - 1] == e &&
+            (char *)iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == mem + offset) {
+            iov[cnt - 1].iov_len += len;
+        } else {
+            if (cnt == *iovcnt) break;
+            iov[cnt].iov_base = (void *)(mem ? mem + offset : zero_block);
+            iov[cnt++].iov_len = len;
+            if (mem && (p->count == 0 || p->extents[p->count - 1] != e)) {
+                __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+                p->extents[p->count++] = e;
+            }
+        }
+        pos += len;
+    }
+    desc->pos = pos;
+    unlock(&f->lock);
+    *iovcnt = cnt;
+    *pin = p;
+    return pos - start;
+}
+
+void ufs_pin_release(struct ufs_pin *pin) {
+    if (!pin) return;
+    for (int i = 0; i < pin->count; i++) extent_unref(pin->extents[i]);
+    free(pin);
+}
+
+off_t ufs_lseek(int fd, off_t offset, int whence) {
+    struct filedesc *desc = fd_lookup(fd);
+    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
+    off_t base;
+    switch (whence) {
+    case UFS_SEEK_SET: base = 0; break;
+    case UFS_SEEK_CUR: base = desc->pos; break;
+    case UFS_SEEK_END:
+        read_lock(&desc->file->lock);
+        base = desc->file->size;
+        unlock(&desc->file->lock);
+        break;
+    default: ufs_error_code = UFS_ERR_INVALID_ARGUMENT; return -1;
+    }
+    if (offset < -base || offset > MAX_FILE_SIZE - base) {
+        ufs_error_code = UFS_ERR_INVALID_ARGUMENT;
+        return -1;
+    }
+    desc->pos = base + offset;
+    return desc->pos;
+}
+
+int ufs_close(int fd) {
+    write_lock(&fds_lock);
+    struct filedesc *desc = fd >= 0 && fd < fds_count ? fds[fd] : NULL;
+    if (desc) fd_free_slot(fd);
+    unlock(&fds_lock);
+    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
+
+    file_put(desc->file);
     free(desc);
-    fds[fd] = NULL;
-    if (fd == fds_count - 1) while (fds_count > 0 && !fds[fds_count - 1]) fds_count--;
-    resize_fds();
     return 0;
 }
 
-int ufs_delete(const char *name) {
-    struct file *f = find_file(name);
-    if (!f) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
-    if (f->refs) f->deleted = 1;
+int ufs_delete(const char *path) {
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    size_t len;
+    struct file *dir = walk(path, 0, &path, &len, &err);
+    if (!dir) { ufs_error_code = err; return -1; }
+    unsigned hash = entry_hash(dir, path, len);
+    struct index_shard *sh = shard_of(hash);
+    write_lock(&sh->lock);
+    struct file *f = find_file(dir, path, len, hash);
+    if (!f) err = UFS_ERR_NO_FILE;
+    else if (f->is_dir) err = UFS_ERR_IS_DIR;
+    else if (f->refs) unlink_file(f);
     else remove_file(f);
-    return 0;
+    unlock(&sh->lock);
+    dir_put(dir);
+    ufs_error_code = err;
+    return err == UFS_ERR_NO_ERR ? 0 : -1;
 }
 
-int ufs_resize(int fd, size_t new_size) {
-    struct filedesc *desc = fd_lookup(fd);
-    if (!desc) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
-    if (!writable(desc)) { ufs_error_code = UFS_ERR_NO_PERMISSION; return -1; }
-    if (new_size > MAX_FILE_SIZE) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
-    struct file *f = desc->file;
-    struct block *blk = f->first;
-    size_t size = 0;
-    int blocks = 0;
+/* Drop a list of extents which is not in a file. */
+static void extents_drop(struct extent *e) {
+    while (e) {
+        struct extent *next = e->next;
+        extent_drop(e);
+        e = next;
+    }
+}
+
+int ufs_clone(const char *src_path, const char *dst_path) {
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    struct file *src = file_get(src_path, 0, &err);
+    if (!src) { ufs_error_code = err; return -1; }
+
+    /* Views of the source extents, made before the target is locked. */
+    read_lock(&src->lock);
+    int count = src->block_count;
+    char **blocks = count ? malloc(sizeof(*blocks) * count) : NULL;
+    struct extent *views = NULL, **tail = &views;
+    if (count && !blocks) err = UFS_ERR_NO_MEM;
+    for (struct extent *e = src->extents; e && err == UFS_ERR_NO_ERR; e = e->next) {
+        struct extent *v = malloc(sizeof(*v));
+        if (!v) { err = UFS_ERR_NO_MEM; break; }
+        struct extent *base = extent_base(e);
+        __atomic_add_fetch(&base->refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&base->shares, 1, __ATOMIC_ACQ_REL);
+        v->first = e->first;
+        v->count = e->count;
+        v->refs = 1;
+        v->shares = 0;
+        v->base = base;
+        v->image = NULL;
+        v->region = NULL;
+        v->mem = e->mem;
+        v->next = NULL;
+        *tail = v;
+        tail = &v->next;
+    }
+    size_t size = src->size;
+    int extent_blocks = src->extent_blocks;
+    if (err == UFS_ERR_NO_ERR) {
+        if (count) memcpy(blocks, src->blocks, sizeof(*blocks) * count);
+        __atomic_store_n(&src->cloned, 1, __ATOMIC_RELAXED);
+    }
+    unlock(&src->lock);
+
+    size_t len;
+    struct file *dir = err == UFS_ERR_NO_ERR ? walk(dst_path, 0, &dst_path, &len, &err) : NULL;
+    struct file *f = NULL;
+    if (dir) {
+        unsigned hash = entry_hash(dir, dst_path, len);
+        struct index_shard *sh = shard_of(hash);
+        write_lock(&sh->lock);
+        struct file *old = find_file(dir, dst_path, len, hash);
+        if (!len || (old && old->is_dir)) err = UFS_ERR_IS_DIR;
+        else if (old && old->refs) unlink_file(old);
+        else if (old) remove_file(old);
+        if (err == UFS_ERR_NO_ERR && !(f = create_file(dir, dst_path, len, hash, 0)))
+            err = UFS_ERR_NO_MEM;
+        if (f) {
+            f->blocks = blocks;
+            f->block_count = f->block_cap = count;
+            f->extents = views;
+            f->extent_blocks = extent_blocks;
+            f->size = size;
+            f->cloned = 1;
+        }
+        unlock(&sh->lock);
+        dir_put(dir);
+    }
+    if (!f) {
+        free(blocks);
+        extents_drop(views);
+    }
+    file_put(src);
+    ufs_error_code = err;
+    return err == UFS_ERR_NO_ERR ? 0 : -1;
+}
+
+int ufs_mkdir(const char *path) {
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    size_t len;
+    struct file *dir = walk(path, 0, &path, &len, &err);
+    if (!dir) { ufs_error_code = err; return -1; }
+    unsigned hash = entry_hash(dir, path, len);
+    struct index_shard *sh = shard_of(hash);
+    write_lock(&sh->lock);
+    if (!len || find_file(dir, path, len, hash)) err = UFS_ERR_EXISTS;
+    else if (!create_file(dir, path, len, hash, 1)) err = UFS_ERR_NO_MEM;
+    unlock(&sh->lock);
+    dir_put(dir);
+    ufs_error_code = err;
+    return err == UFS_ERR_NO_ERR ? 0 : -1;
+}
 
-    while (blk) {
-        size += blk->used;
-        if (size > new_size) break;
-        blk = blk->next;
-        blocks++;
+int ufs_rmdir(const char *path) {
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    size_t len;
+    struct file *dir = walk(path, 0, &path, &len, &err);
+    if (!dir) { ufs_error_code = err; return -1; }
+    unsigned hash = entry_hash(dir, path, len);
+    struct index_shard *sh = shard_of(hash);
+    write_lock(&sh->lock);
+    struct file *d = find_file(dir, path, len, hash);
+    if (!len) err = UFS_ERR_NOT_EMPTY;
+    else if (!d) err = UFS_ERR_NO_FILE;
+    else if (!d->is_dir) err = UFS_ERR_NOT_DIR;
+    else {
+        /* A walk through the directory can be about to add an entry. */
+        read_lock(&d->lock);
+        if (d->children || d->refs) err = UFS_ERR_NOT_EMPTY;
+        unlock(&d->lock);
+        if (err == UFS_ERR_NO_ERR) remove_file(d);
     }
+    unlock(&sh->lock);
+    dir_put(dir);
+    ufs_error_code = err;
+    return err == UFS_ERR_NO_ERR ? 0 : -1;
+}
 
-    if (size > new_size) {
-        free_blocks(blk->next);
-        f->last = blk;
-        blk->used = new_size - blocks * BLOCK_SIZE;
+/* A copy of the entry list, the names follow the entries. */
+struct ufs_dir {
+    int count, pos;
+    struct ufs_dirent entries[];
+};
 
-        for (int i = 0; i < fds_count; i++) {
-            struct filedesc *d = fds[i];
-            if (!d || d->file != f) continue;
-            if (d->block_num >= blocks) {
-                d->block_num = blocks;
-                if (d->offset > blk->used)
-                    d->offset = blk->used;
+struct ufs_dir *ufs_opendir(const char *path) {
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    size_t len;
+    struct file *dir = walk(path, 0, &path, &len, &err);
+    if (!dir) { ufs_error_code = err; return NULL; }
+    struct index_shard *sh = NULL;
+    struct file *d = dir;
+    if (len) {
+        unsigned hash = entry_hash(dir, path, len);
+        sh = shard_of(hash);
+        read_lock(&sh->lock);
+        d = find_file(dir, path, len, hash);
+        if (!d) err = UFS_ERR_NO_FILE;
+        else if (!d->is_dir) err = UFS_ERR_NOT_DIR;
+    }
+    struct ufs_dir *res = NULL;
+    if (err == UFS_ERR_NO_ERR) {
+        read_lock(&d->lock);
+        int count = 0;
+        size_t names_size = 0;
+        for (struct file *f = d->children; f; f = f->dnext, count++)
+            names_size += strlen(f->name) + 1;
+        res = malloc(sizeof(*res) + count * sizeof(res->entries[0]) + names_size);
+        if (res) {
+            res->count = count;
+            res->pos = 0;
+            char *names = (char *)&res->entries[count];
+            struct ufs_dirent *e = res->entries;
+            for (struct file *f = d->children; f; f = f->dnext, e++) {
+                size_t n = strlen(f->name) + 1;
+                memcpy(names, f->name, n);
+                e->name = names;
+                e->is_dir = f->is_dir;
+                names += n;
             }
+        } else {
+            err = UFS_ERR_NO_MEM;
         }
-    } else {
-        if (blk) { size += BLOCK_SIZE - blk->used; blk->used = BLOCK_SIZE; }
-        while (size < new_size) {
-            if (add_block(f) != UFS_ERR_NO_ERR) return -1;
-            f->last->used = BLOCK_SIZE;
-            size += BLOCK_SIZE;
-            blocks++;
+        unlock(&d->lock);
+    }
+    if (sh) unlock(&sh->lock);
+    dir_put(dir);
+    ufs_error_code = err;
+    return res;
+}
+
+const struct ufs_dirent *ufs_readdir(struct ufs_dir *dir) {
+    return dir->pos < dir->count ? &dir->entries[dir->pos++] : NULL;
+}
+
+void ufs_closedir(struct ufs_dir *dir) {
+    free(dir);
+}
+
+int ufs_resize(int fd, size_t new_size) {
+    struct filedesc *desc = fd_for_write(fd);
+    if (!desc) return -1;
+    if (new_size > MAX_FILE_SIZE) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
+    struct file *f = desc->file;
+    int blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int rc = 0;
+
+    write_lock(&f->lock);
+    size_t tail = new_size % BLOCK_SIZE;
+    char *last = new_size < f->size && tail ? f->blocks[blocks - 1] : NULL;
+    /*
+     * Keep the tail past the end zeroed for a later grow. A read view
+     * keeps seeing the cut data, it gets a copy of the block.
+     */
+    struct extent *own;
+    if (last && !(last = block_writable(f, blocks - 1, 1, 1, &own))) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        rc = -1;
+    } else if (new_size < f->size) {
+        if (last) memset(last + tail, 0, BLOCK_SIZE - tail);
+        free_blocks(f, blocks);
+        read_lock(&fds_lock);
+        for (int i = 0; i < fds_count; i++) {
+            struct filedesc *d = fds[i];
+            if (d && d->file == f && d->pos > new_size) d->pos = new_size;
         }
-        f->last->used = new_size - blocks * BLOCK_SIZE;
+        unlock(&fds_lock);
+    } else if (table_grow(f, blocks) != UFS_ERR_NO_ERR) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        rc = -1;
     }
-    return 0;
+    if (rc == 0) f->size = new_size;
+    unlock(&f->lock);
+    return rc;
 }
 
 void ufs_destroy() {
     for (int i = 0; i < fds_count; i++) free(fds[i]);
     free(fds);
+    free(fd_busy);
+    free(fd_full);
     while (all_files) remove_file(all_files);
+    for (int i = 0; i < INDEX_SHARDS; i++) free(shards[i].buckets);
+    while (regions) {
+        struct region *r = regions;
+        regions = r->next;
+        munmap(r->mem, REGION_SIZE);
+        free(r);
+    }
+    empty_region = NULL;
+    alloc_region = NULL;
+}
+
+/*
+ * Snapshot image: a header, the file table, then the data of each
+ * file from a block aligned offset. Holes are not written, so they
+ * stay holes in the image file too. An entry name is the full path,
+ * the directories have entries too, to keep the empty ones.
+ */
+#define IMAGE_MAGIC 0x31534655 /* "UFS1" */
+#define IMAGE_DIR 1
+
+struct image_header {
+    uint32_t magic;
+    uint32_t file_count;
+};
+
+struct image_entry {
+    uint64_t size;
+    uint64_t offset;
+    uint32_t name_len;
+    uint32_t flags;
+    /* Followed by the name without the terminating zero. */
+};
+
+/* Length of the path from the root to @a f, without the leading '/'. */
+static size_t path_len(const struct file *f) {
+    size_t len = strlen(f->name);
+    for (f = f->parent; f != &root; f = f->parent) len += strlen(f->name) + 1;
+    return len;
+}
+
+/* Write the path of @a f backwards, so it ends right before @a end. */
+static void put_path(const struct file *f, char *end) {
+    for (;;) {
+        size_t n = strlen(f->name);
+        end -= n;
+        memcpy(end, f->name, n);
+        if ((f = f->parent) == &root) break;
+        *--end = '/';
+    }
+}
+
+static size_t align_block(size_t size) {
+    return (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+static int write_all(int fd, const char *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t rc = pwrite(fd, buf, size, offset);
+        if (rc < 0) return -1;
+        buf += rc;
+        size -= rc;
+        offset += rc;
+    }
+    return 0;
+}
+
+/* Write runs of blocks lying one after another by one call. */
+static int write_file_data(int fd, struct file *f, off_t offset) {
+    int i = 0;
+    while (i < f->block_count) {
+        if (!f->blocks[i]) { i++; continue; }
+        int j = i + 1;
+        while (j < f->block_count && f->blocks[j] == f->blocks[j - 1] + BLOCK_SIZE) j++;
+        size_t len = (size_t)(j - i) * BLOCK_SIZE;
+        if ((size_t)j * BLOCK_SIZE > f->size) len -= (size_t)j * BLOCK_SIZE - f->size;
+        if (write_all(fd, f->blocks[i], len, offset + (off_t)i * BLOCK_SIZE) != 0) return -1;
+        i = j;
+    }
+    return 0;
+}
+
+int ufs_snapshot(const char *path) {
+    for (int i = 0; i < INDEX_SHARDS; i++) read_lock(&shards[i].lock);
+    /* The table goes first, the data offsets are known only after it. */
+    size_t table_size = sizeof(struct image_header);
+    uint32_t count = 0;
+    for (int i = 0; i < INDEX_SHARDS; i++) {
+        for (unsigned b = 0; b < shards[i].cap; b++) {
+            for (struct file *f = shards[i].buckets[b]; f; f = f->hnext) {
+                table_size += sizeof(struct image_entry) + path_len(f);
+                count++;
+            }
+        }
+    }
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    /*
+     * A restored image is mapped by the files, truncating it under them
+     * would crash the readers. A new image replaces the old one whole.
+     */
+    size_t path_size = strlen(path);
+    char *table = malloc(table_size), *tmp_path = malloc(path_size + sizeof(".tmp"));
+    int fd = -1;
+    if (tmp_path) {
+        memcpy(tmp_path, path, path_size);
+        memcpy(tmp_path + path_size, ".tmp", sizeof(".tmp"));
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (!table || !tmp_path) err = UFS_ERR_NO_MEM;
+    else if (fd < 0) err = UFS_ERR_IO;
+
+    struct image_header header = {IMAGE_MAGIC, count};
+    if (table) memcpy(table, &header, sizeof(header));
+    size_t pos = sizeof(header), data_end = align_block(table_size);
+    for (int i = 0; i < INDEX_SHARDS && err == UFS_ERR_NO_ERR; i++) {
+        for (unsigned b = 0; b < shards[i].cap && err == UFS_ERR_NO_ERR; b++) {
+            for (struct file *f = shards[i].buckets[b]; f; f = f->hnext) {
+                read_lock(&f->lock);
+                struct image_entry e = {f->size, data_end, path_len(f),
+                                        f->is_dir ? IMAGE_DIR : 0};
+                memcpy(table + pos, &e, sizeof(e));
+                put_path(f, table + pos + sizeof(e) + e.name_len);
+                pos += sizeof(e) + e.name_len;
+                if (write_file_data(fd, f, data_end) != 0) err = UFS_ERR_IO;
+                data_end += align_block(f->size);
+                unlock(&f->lock);
+                if (err != UFS_ERR_NO_ERR) break;
+            }
+        }
+    }
+    for (int i = 0; i < INDEX_SHARDS; i++) unlock(&shards[i].lock);
+    if (err == UFS_ERR_NO_ERR &&
+        (write_all(fd, table, table_size, 0) != 0 || ftruncate(fd, data_end) != 0 ||
+         fsync(fd) != 0))
+        err = UFS_ERR_IO;
+    if (fd >= 0 && close(fd) != 0 && err == UFS_ERR_NO_ERR) err = UFS_ERR_IO;
+    if (err == UFS_ERR_NO_ERR && rename(tmp_path, path) != 0) err = UFS_ERR_IO;
+    if (fd >= 0 && err != UFS_ERR_NO_ERR) unlink(tmp_path);
+    free(tmp_path);
+    free(table);
+    ufs_error_code = err;
+    return err == UFS_ERR_NO_ERR ? 0 : -1;
+}
+
+/*
+ * Make a file of the image entry, its blocks point into the image.
+ * The missing directories on the path are created.
+ */
+static enum ufs_error_code restore_file(struct image *img, const char *path,
+                                        const struct image_entry *e) {
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    size_t len;
+    struct file *dir = walk(path, 1, &path, &len, &err);
+    if (!dir) return err;
+    if (e->flags & IMAGE_DIR) {
+        struct file *d = len ? dir_get(dir, path, len, 1, &err) : NULL;
+        if (d) dir_put(d);
+        dir_put(dir);
+        return err;
+    }
+    if (!len) { dir_put(dir); return UFS_ERR_IS_DIR; }
+    unsigned hash = entry_hash(dir, path, len);
+    struct index_shard *sh = shard_of(hash);
+    int blocks = align_block(e->size) / BLOCK_SIZE;
+    struct extent *ext = NULL;
+    if (blocks > 0) {
+        ext = malloc(sizeof(*ext));
+        if (!ext) { dir_put(dir); return UFS_ERR_NO_MEM; }
+        ext->first = 0;
+        ext->count = blocks;
+        ext->refs = 1;
+        ext->shares = 1;
+        ext->base = NULL;
+        ext->image = img;
+        ext->region = NULL;
+        ext->mem = (char *)img->addr + e->offset;
+        ext->next = NULL;
+    }
+    write_lock(&sh->lock);
+    struct file *old = find_file(dir, path, len, hash), *f = NULL;
+    if (old && old->is_dir) err = UFS_ERR_IS_DIR;
+    else if (old && old->refs) unlink_file(old);
+    else if (old) remove_file(old);
+    if (err == UFS_ERR_NO_ERR && !(f = create_file(dir, path, len, hash, 0)))
+        err = UFS_ERR_NO_MEM;
+    if (f && table_grow(f, blocks) != UFS_ERR_NO_ERR) {
+        remove_file(f);
+        f = NULL;
+        err = UFS_ERR_NO_MEM;
+    }
+    /* The file is found only via the index, fill it before the index is unlocked. */
+    if (f && ext) {
+        __atomic_add_fetch(&img->refs, 1, __ATOMIC_RELAXED);
+        f->extents = ext;
+        f->extent_blocks = blocks;
+        for (int i = 0; i < blocks; i++) f->blocks[i] = ext->mem + (size_t)i * BLOCK_SIZE;
+    }
+    if (f) f->size = e->size;
+    unlock(&sh->lock);
+    dir_put(dir);
+    if (!f) free(ext);
+    return err;
+}
+
+int ufs_restore(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { ufs_error_code = UFS_ERR_NO_FILE; return -1; }
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); ufs_error_code = UFS_ERR_IO; return -1; }
+    size_t size = st.st_size;
+    struct image_header header;
+    if (size < sizeof(header)) { close(fd); ufs_error_code = UFS_ERR_INVALID_ARGUMENT; return -1; }
+    /* Private mapping: writes to the restored files don't go to the image. */
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) { ufs_error_code = UFS_ERR_NO_MEM; return -1; }
+    struct image *img = malloc(sizeof(*img));
+    if (!img) { munmap(addr, size); ufs_error_code = UFS_ERR_NO_MEM; return -1; }
+    img->addr = addr;
+    img->size = size;
+    img->refs = 1;
+
+    enum ufs_error_code err = UFS_ERR_NO_ERR;
+    memcpy(&header, addr, sizeof(header));
+    if (header.magic != IMAGE_MAGIC) err = UFS_ERR_INVALID_ARGUMENT;
+    size_t pos = sizeof(header);
+    for (uint32_t i = 0; i < header.file_count && err == UFS_ERR_NO_ERR; i++) {
+        struct image_entry e;
+        if (size - pos < sizeof(e)) { err = UFS_ERR_INVALID_ARGUMENT; break; }
+        memcpy(&e, (char *)addr + pos, sizeof(e));
+        pos += sizeof(e);
+        if (size - pos < e.name_len || e.size > MAX_FILE_SIZE ||
+            e.offset % BLOCK_SIZE != 0 || e.offset > size ||
+            size - e.offset < align_block(e.size)) {
+            err = UFS_ERR_INVALID_ARGUMENT;
+            break;
+        }
+        char *name = strndup((char *)addr + pos, e.name_len);
+        pos += e.name_len;
+        err = name ? restore_file(img, name, &e) : UFS_ERR_NO_MEM;
+        free(name);
+    }
+    image_unref(img);
+    ufs_error_code = err;
+    return err == UFS_ERR_NO_ERR ? 0 : -1;
 }
@@ -26,6 +26,18 @@
 #define NEED_OPEN_FLAGS 1
 #define NEED_RESIZE 1
 
+/**
+ * Build with -DUFS_THREAD_SAFE=1 to use the FS from several threads.
+ * Then the name index, the descriptor table and each file are locked,
+ * and ufs_errno() is per thread. Different files and reads of one
+ * file go in parallel. A single descriptor still must not be used by
+ * several threads at once, ufs_pread() and ufs_pwrite() can share a
+ * file without sharing a descriptor. ufs_destroy() is not thread-safe.
+ */
+#ifndef UFS_THREAD_SAFE
+#define UFS_THREAD_SAFE 0
+#endif
+
 /**
  * Flags for ufs_open call.
  */
@@ -67,6 +79,47 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARGUMENT,
+	UFS_ERR_IO,
+	UFS_ERR_EXISTS,
+	UFS_ERR_NOT_DIR,
+	UFS_ERR_IS_DIR,
+	UFS_ERR_NOT_EMPTY,
+};
+
+/** Origin of the offset in ufs_lseek(). */
+enum ufs_seek_whence {
+	UFS_SEEK_SET,
+	UFS_SEEK_CUR,
+	UFS_SEEK_END,
+};
+
+/** A buffer for vectored IO, like struct iovec. */
+struct ufs_iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+/** Keeps the memory given by ufs_read_view() alive. */
+struct ufs_pin;
+
+/** An entry of a directory, see ufs_readdir(). */
+struct ufs_dirent {
+	const char *name;
+	int is_dir;
+};
+
+/** An open directory listing. */
+struct ufs_dir;
+
+/** Where the file blocks are allocated, see ufs_set_storage(). */
+enum ufs_storage {
+	/** Each extent of blocks is a malloc() chunk. */
+	UFS_STORAGE_HEAP,
+	/** Extents are carved from 2MB anonymous mappings. */
+	UFS_STORAGE_MMAP,
+	/** Same as UFS_STORAGE_MMAP, but asking for huge pages. */
+	UFS_STORAGE_MMAP_HUGE,
 };
 
 /** Get code of the last error. */
@@ -74,14 +127,18 @@ enum ufs_error_code
 ufs_errno();
 
 /**
- * Open a file by filename.
- * @param filename Name of a file to open.
+ * Open a file by its path. The path components are separated by '/',
+ * a name without '/' is a file in the root directory. The directories
+ * on the path are not created, see ufs_mkdir().
+ * @param filename Path of a file to open.
  * @param flags Bitwise combination of open_flags.
  *
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no directory on the path.
+ *     - UFS_ERR_NOT_DIR - a path component is not a directory.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -114,6 +171,120 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data at the given offset of the file. The descriptor position
+ * is not used and not changed. Writing past the file end leaves a
+ * hole which reads as zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory or the file would be too big.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the given offset of the file. The descriptor position
+ * is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write the buffers one after another, like one ufs_write() of their
+ * concatenation.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory or the file would be too big.
+ *     - UFS_ERR_INVALID_ARGUMENT - negative @a iovcnt.
+ */
+ssize_t
+ufs_writev(int fd, const struct ufs_iovec *iov, int iovcnt);
+
+/**
+ * Fill the buffers one after another, like one ufs_read() into their
+ * concatenation.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARGUMENT - negative @a iovcnt.
+ */
+ssize_t
+ufs_readv(int fd, const struct ufs_iovec *iov, int iovcnt);
+
+/**
+ * Read data without copying: fill @a iov with pointers right into the
+ * file memory, starting from the descriptor position, and move the
+ * position. The memory stays valid until ufs_pin_release(), even if
+ * the file is truncated or deleted meanwhile. But writes to the file
+ * are visible through it, except those to the blocks shared with a
+ * clone, and holes are given as a shared block of zeros. The memory
+ * must not be written.
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to read.
+ * @param[out] iov Buffers to fill.
+ * @param[in,out] iovcnt Count of @a iov, then how many are filled.
+ *   When it is not enough, less than @a size is read.
+ * @param[out] pin Pin to release when the memory is not needed.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF. The pin still must be released.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARGUMENT - no @a iov, @a iovcnt or @a pin.
+ */
+ssize_t
+ufs_read_view(int fd, size_t size, struct ufs_iovec *iov, int *iovcnt,
+	      struct ufs_pin **pin);
+
+/**
+ * Release memory from ufs_read_view().
+ * @param pin Pin from ufs_read_view(), may be NULL.
+ */
+void
+ufs_pin_release(struct ufs_pin *pin);
+
+/**
+ * Move the descriptor position. It may go past the file end, then
+ * the next write leaves a hole which reads as zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence.
+ * @param whence One of enum ufs_seek_whence.
+ *
+ * @retval >= 0 New position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARGUMENT - bad @a whence, or the position would
+ *       be negative or past the max file size.
+ */
+off_t
+ufs_lseek(int fd, off_t offset, int whence);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -132,13 +303,90 @@ ufs_close(int fd);
  * same name immediately and it should not affect existing opened
  * descriptors of the deleted file.
  *
- * @param filename Name of a file to delete.
+ * @param filename Path of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_NOT_DIR - a path component is not a directory.
+ *     - UFS_ERR_IS_DIR - the path is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Make a copy of a file without copying the data: the copy shares the
+ * blocks with the source, and a block is copied only when either file
+ * writes into it. So the memory grows only with the changed blocks. A
+ * file by the target path is deleted as by ufs_delete(). Opened
+ * descriptors of the source keep working with the source.
+ * @param src Path of the file to copy.
+ * @param dst Path of the copy, its directory must exist.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no source file, or no target directory.
+ *     - UFS_ERR_NOT_DIR - a path component is not a directory.
+ *     - UFS_ERR_IS_DIR - a path is a directory.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Create a directory. Its parent must exist.
+ * @param path Path of the new directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_EXISTS - there is a file or a directory by the path.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_NOT_DIR - a path component is not a directory.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ * @param path Path of the directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is not a directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries or is being
+ *       walked through by another thread. The root can't be deleted.
+ */
+int
+ufs_rmdir(const char *path);
+
+/**
+ * Start listing a directory. The entries are copied at once, later
+ * changes of the directory are not seen by the listing.
+ * @param path Path of the directory, "" or "/" is the root.
+ *
+ * @retval Not NULL Listing, to pass to ufs_readdir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path is not a directory.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Next entry of a listing, in no particular order.
+ * @param dir Listing from ufs_opendir().
+ *
+ * @retval Not NULL Entry, valid until ufs_closedir().
+ * @retval NULL No more entries.
+ */
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir);
+
+/** Free a listing made by ufs_opendir(). */
+void
+ufs_closedir(struct ufs_dir *dir);
+
 #if NEED_RESIZE
 
 /**
@@ -164,6 +412,53 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Save all the files and directories, except the deleted ones, into
+ * an image file at @a path. The data is written by big runs, the
+ * holes are skipped.
+ * @param path Image file path. The image is written next to it and
+ *        then renamed over it, so the files restored from an old
+ *        image at this path keep working.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_IO - could not write the image.
+ */
+int
+ufs_snapshot(const char *path);
+
+/**
+ * Load the files from an image made by ufs_snapshot(). The image is
+ * mapped, not read: the files point right into it, and the data is
+ * loaded on the first access. Writes to the files don't change the
+ * image. A file with the same path as a restored one is deleted as
+ * by ufs_delete(). The missing directories are created. On an error
+ * some files can be already restored.
+ * @param path Image file path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no image file.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARGUMENT - the file is not a valid image.
+ *     - UFS_ERR_IO - could not read the image.
+ *     - UFS_ERR_NOT_DIR, UFS_ERR_IS_DIR - a restored path clashes
+ *       with an existing file or directory.
+ */
+int
+ufs_restore(const char *path);
+
+/**
+ * Choose where the blocks allocated from now on are stored. The
+ * already allocated blocks stay where they are. The mmap storage
+ * gives the memory of freed blocks back to the kernel and does not
+ * fragment the heap with big chunks.
+ * @param storage Storage kind.
+ */
+void
+ufs_set_storage(enum ufs_storage storage);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
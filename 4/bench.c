@@ -0,0 +1,186 @@
+/*
+ * Scaling of thread_pool_parallel_for() against the naive way of
+ * splitting an array: push one task per chunk, then join them all.
+ * One kernel is bound by memory bandwidth, another one by CPU.
+ *
+ *     make bench && ./bench
+ */
+#include "thread_pool.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	MEM_SIZE = 1 << 22,
+	MEM_GRAIN = 1 << 14,
+	CPU_SIZE = 1 << 16,
+	CPU_GRAIN = 1 << 8,
+	CPU_ROUNDS = 200,
+	REPEAT = 5,
+};
+
+struct kernel {
+	const char *name;
+	size_t size;
+	size_t grain;
+	thread_range_f fn;
+};
+
+static double *a, *b, *c;
+
+static void
+mem_kernel_f(size_t begin, size_t end, void *ctx)
+{
+	(void)ctx;
+	for (size_t i = begin; i < end; ++i)
+		a[i] = b[i] * 3.0 + c[i];
+}
+
+static void
+cpu_kernel_f(size_t begin, size_t end, void *ctx)
+{
+	(void)ctx;
+	for (size_t i = begin; i < end; ++i) {
+		double x = b[i];
+		for (int r = 0; r < CPU_ROUNDS; ++r)
+			x = sqrt(x * x + 1.0) - 0.5;
+		a[i] = x;
+	}
+}
+
+struct chunk {
+	const struct kernel *kernel;
+	size_t begin;
+	size_t end;
+};
+
+static void *
+chunk_task_f(void *arg)
+{
+	struct chunk *chunk = arg;
+	chunk->kernel->fn(chunk->begin, chunk->end, NULL);
+	return NULL;
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run_naive(struct thread_pool *pool, const struct kernel *kernel)
+{
+	size_t count = (kernel->size + kernel->grain - 1) / kernel->grain;
+	struct chunk *chunks = malloc(count * sizeof(*chunks));
+	struct thread_task **tasks = malloc(count * sizeof(*tasks));
+	for (size_t i = 0; i < count; ++i) {
+		chunks[i].kernel = kernel;
+		chunks[i].begin = i * kernel->grain;
+		chunks[i].end = chunks[i].begin + kernel->grain;
+		if (chunks[i].end > kernel->size)
+			chunks[i].end = kernel->size;
+		thread_task_new(&tasks[i], chunk_task_f, &chunks[i]);
+		thread_pool_push_task(pool, tasks[i]);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		void *result;
+		thread_task_join(tasks[i], &result);
+		thread_task_delete(tasks[i]);
+	}
+	free(tasks);
+	free(chunks);
+}
+
+static void
+run_parallel_for(struct thread_pool *pool, const struct kernel *kernel)
+{
+	thread_pool_parallel_for(pool, 0, kernel->size, kernel->grain,
+				 kernel->fn, NULL);
+}
+
+/** One thread alone, the base of the parallel_for scaling. */
+static void
+run_serial(struct thread_pool *pool, const struct kernel *kernel)
+{
+	(void)pool;
+	kernel->fn(0, kernel->size, NULL);
+}
+
+static double
+measure(struct thread_pool *pool, const struct kernel *kernel,
+	void (*run)(struct thread_pool *, const struct kernel *))
+{
+	double best = INFINITY;
+	for (int i = 0; i < REPEAT; ++i) {
+		double start = now_sec();
+		run(pool, kernel);
+		double t = now_sec() - start;
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+int
+main(void)
+{
+	a = malloc(MEM_SIZE * sizeof(*a));
+	b = malloc(MEM_SIZE * sizeof(*b));
+	c = malloc(MEM_SIZE * sizeof(*c));
+	for (size_t i = 0; i < MEM_SIZE; ++i) {
+		a[i] = 0;
+		b[i] = i % 1000;
+		c[i] = i % 7;
+	}
+	const struct kernel kernels[] = {
+		{"memory", MEM_SIZE, MEM_GRAIN, mem_kernel_f},
+		{"compute", CPU_SIZE, CPU_GRAIN, cpu_kernel_f},
+	};
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = cpus > TPOOL_MAX_THREADS ? TPOOL_MAX_THREADS :
+		(int)cpus;
+
+	printf("%-8s %7s %12s %12s %9s %9s\n", "kernel", "threads",
+	       "naive_ms", "pfor_ms", "naive_x", "pfor_x");
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+		double naive_base = 0, pfor_base = 0;
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			struct thread_pool *pool;
+			thread_pool_new(threads, &pool);
+			/*
+			 * parallel_for also uses the calling thread, so
+			 * give it one thread less for a fair comparison.
+			 */
+			struct thread_pool *pfor_pool = NULL;
+			if (threads > 1)
+				thread_pool_new(threads - 1, &pfor_pool);
+			double naive = measure(pool, &kernels[k], run_naive);
+			double pfor = pfor_pool != NULL ?
+				measure(pfor_pool, &kernels[k],
+					run_parallel_for) :
+				measure(NULL, &kernels[k], run_serial);
+			if (threads == 1) {
+				naive_base = naive;
+				pfor_base = pfor;
+			}
+			printf("%-8s %7d %12.3f %12.3f %9.2f %9.2f\n",
+			       kernels[k].name, threads, naive * 1000,
+			       pfor * 1000, naive_base / naive,
+			       pfor_base / pfor);
+			thread_pool_delete(pool);
+			if (pfor_pool != NULL)
+				thread_pool_delete(pfor_pool);
+		}
+	}
+	free(a);
+	free(b);
+	free(c);
+	return 0;
+}
@@ -1,6 +1,11 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "thread_pool.h"
 #include "unit.h"
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -47,6 +52,17 @@ task_wait_for_f(void *arg)
 	return arg;
 }
 
+#ifdef __linux__
+
+static void *
+task_get_cpu_f(void *arg)
+{
+	(void)arg;
+	return (void *)(intptr_t)sched_getcpu();
+}
+
+#endif
+
 static void
 test_push(void)
 {
@@ -254,6 +270,536 @@ test_thread_pool_max_tasks(void)
 }
 
 
+static void
+test_idle_shrink(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_options opts = {
+		.max_thread_count = 4,
+		.min_thread_count = 5,
+		.idle_timeout = 0.05,
+	};
+	unit_check(thread_pool_new_ex(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "min > max is forbidden");
+	opts.min_thread_count = 1;
+	opts.idle_timeout = -1;
+	unit_check(thread_pool_new_ex(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative timeout is forbidden");
+	opts.idle_timeout = 0.05;
+	unit_check(thread_pool_new_ex(&opts, &p) == 0, "created");
+	/*
+	 * Occupy all the threads.
+	 */
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[4];
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+		usleep(1000);
+	}
+	unit_check(thread_pool_thread_count(p) == 4, "grown to max");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	/*
+	 * Surplus threads go away, but not below the minimum.
+	 */
+	while (thread_pool_thread_count(p) > 1)
+		usleep(1000);
+	usleep(100000);
+	unit_check(thread_pool_thread_count(p) == 1, "shrunk to min");
+	/*
+	 * The pool grows again on demand.
+	 */
+	arg = 0;
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+		usleep(1000);
+	}
+	unit_check(thread_pool_thread_count(p) == 4, "grown again");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct order_arg {
+	int *counter;
+	int *flag;
+	int seq;
+};
+
+static void *
+task_order_f(void *arg)
+{
+	struct order_arg *a = arg;
+	if (a->flag != NULL)
+		task_wait_for_f(a->flag);
+	a->seq = __atomic_add_fetch(a->counter, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+static void
+test_continuations(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	int counter = 0;
+	int flag = 0;
+	void *result;
+	/*
+	 * A chain: a -> b -> c.
+	 */
+	struct order_arg args[4] = {
+		{&counter, &flag, 0}, {&counter, NULL, 0},
+		{&counter, NULL, 0}, {&counter, NULL, 0},
+	};
+	struct thread_task *a, *b, *c, *d;
+	unit_fail_if(thread_task_new(&a, task_order_f, &args[0]) != 0);
+	unit_fail_if(thread_task_new(&b, task_order_f, &args[1]) != 0);
+	unit_fail_if(thread_task_new(&c, task_order_f, &args[2]) != 0);
+	unit_check(thread_task_then(a, b) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "can't wait for a not pushed task");
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_check(thread_task_then(a, b) == 0, "b after a");
+	unit_check(thread_task_then(b, c) == 0, "c after b");
+	unit_check(thread_pool_push_task(p, b) == TPOOL_ERR_TASK_IN_POOL,
+		   "can't push a waiting task");
+	usleep(10000);
+	unit_check(!thread_task_is_finished(b) && !thread_task_is_running(b),
+		   "b waits");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_join(c, &result) == 0, "joined the last one");
+	unit_check(args[0].seq == 1 && args[1].seq == 2 && args[2].seq == 3,
+		   "the chain is run in order");
+	unit_fail_if(thread_task_join(a, &result) != 0);
+	unit_fail_if(thread_task_join(b, &result) != 0);
+	/*
+	 * A finished task releases its continuation immediately.
+	 */
+	unit_fail_if(thread_task_new(&d, task_order_f, &args[3]) != 0);
+	unit_check(thread_task_then(c, d) == 0, "d after finished c");
+	unit_fail_if(thread_task_join(d, &result) != 0);
+	unit_check(args[3].seq == 4, "d is done");
+	/*
+	 * Fan-in: d after a, b, c.
+	 */
+	counter = 0;
+	flag = 0;
+	for (int i = 0; i < 3; ++i)
+		args[i].flag = &flag;
+	struct thread_task *group[3] = {a, b, c};
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_pool_push_task(p, group[i]) != 0);
+	unit_check(thread_task_when_all(group, 3, d) == 0, "d after all");
+	usleep(10000);
+	unit_check(!thread_task_is_finished(d), "d waits for all");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(d, &result) != 0);
+	unit_check(args[3].seq == 4, "d is the last");
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(thread_task_join(group[i], &result) != 0);
+		unit_fail_if(thread_task_delete(group[i]) != 0);
+	}
+	unit_fail_if(thread_task_delete(d) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_priorities(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int counter = 0;
+	int flag = 0;
+	void *result;
+	struct thread_task *t;
+	/*
+	 * Occupy the only thread while the queues are filled.
+	 */
+	struct order_arg blocker_arg = {&counter, &flag, 0};
+	unit_fail_if(thread_task_new(&t, task_order_f, &blocker_arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (!thread_task_is_running(t))
+		usleep(100);
+	unit_check(thread_pool_push_task_prio(p, t, TPOOL_PRIO_COUNT) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad priority");
+
+	enum { COUNT = 20 };
+	struct order_arg args[2 * COUNT];
+	struct thread_task *tasks[2 * COUNT];
+	for (int i = 0; i < 2 * COUNT; ++i) {
+		args[i] = (struct order_arg){&counter, NULL, 0};
+		unit_fail_if(thread_task_new(&tasks[i], task_order_f,
+					     &args[i]) != 0);
+		unit_fail_if(thread_pool_push_task_prio(p, tasks[i],
+			i < COUNT ? TPOOL_PRIO_LOW : TPOOL_PRIO_HIGH) != 0);
+	}
+	unit_check(thread_pool_queue_size(p, TPOOL_PRIO_LOW) == COUNT &&
+		   thread_pool_queue_size(p, TPOOL_PRIO_NORMAL) == 0 &&
+		   thread_pool_queue_size(p, TPOOL_PRIO_HIGH) == COUNT,
+		   "queue sizes");
+
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 2 * COUNT; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+
+	int last_high = 0;
+	for (int i = COUNT; i < 2 * COUNT; ++i) {
+		if (args[i].seq > last_high)
+			last_high = args[i].seq;
+	}
+	int low_before = 0;
+	for (int i = 0; i < COUNT; ++i)
+		low_before += args[i].seq < last_high;
+	unit_check(low_before > 0, "low priority isn't starved");
+	unit_check(low_before <= 2, "high priority goes mostly first");
+	unit_check(thread_pool_queue_size(p, TPOOL_PRIO_LOW) == 0 &&
+		   thread_pool_queue_size(p, TPOOL_PRIO_HIGH) == 0,
+		   "queues are empty");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_affinity(void)
+{
+#ifdef __linux__
+	unit_test_start();
+
+	cpu_set_t allowed;
+	unit_fail_if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0);
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &allowed))
+		++cpu;
+
+	struct thread_pool *p;
+	int bad_cpu = -1;
+	struct thread_pool_options opts = {
+		.max_thread_count = 2,
+		.idle_timeout = 1e10,
+		.cpus = &bad_cpu,
+		.cpu_count = 1,
+		.numa_aware = true,
+	};
+	unit_check(thread_pool_new_ex(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "bad CPU number");
+	opts.cpus = &cpu;
+	unit_check(thread_pool_new_ex(&opts, &p) == 0, "created pinned");
+
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[2];
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	/*
+	 * Check where the tasks have been running.
+	 */
+	for (int i = 0; i < 10; ++i) {
+		struct thread_task *t;
+		unit_fail_if(thread_task_new(&t, task_get_cpu_f, NULL) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		unit_fail_if(thread_task_delete(t) != 0);
+		unit_fail_if((intptr_t)result != cpu);
+	}
+	unit_check(true, "tasks run on the given CPU");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+range_mark_f(size_t begin, size_t end, void *ctx)
+{
+	int *marks = ctx;
+	for (size_t i = begin; i < end; ++i)
+		__atomic_add_fetch(&marks[i], 1, __ATOMIC_RELAXED);
+}
+
+static void
+range_sum_f(size_t begin, size_t end, void *acc, void *ctx)
+{
+	(void)ctx;
+	for (size_t i = begin; i < end; ++i)
+		*(uint64_t *)acc += i;
+}
+
+static void
+sum_combine_f(void *acc, const void *other, void *ctx)
+{
+	(void)ctx;
+	*(uint64_t *)acc += *(const uint64_t *)other;
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { COUNT = 100000 };
+	int *marks = calloc(COUNT, sizeof(*marks));
+	unit_check(thread_pool_parallel_for(p, 0, COUNT, 0, NULL, marks) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no function");
+	unit_check(thread_pool_parallel_for(p, 0, COUNT, 7, range_mark_f,
+					    marks) == 0, "parallel for");
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i)
+		ok = ok && marks[i] == 1;
+	unit_check(ok, "each index is visited once");
+	unit_check(thread_pool_parallel_for(p, 10, 10, 1, range_mark_f,
+					    marks) == 0, "empty range");
+	unit_check(thread_pool_parallel_for(p, 0, COUNT, SIZE_MAX, range_mark_f,
+					    marks) == 0, "huge grain");
+	ok = true;
+	for (int i = 0; i < COUNT; ++i)
+		ok = ok && marks[i] == 2;
+	unit_check(ok, "huge grain visits each index once");
+
+	uint64_t sum = 0;
+	unit_check(thread_pool_parallel_reduce(p, 0, COUNT, 100, range_sum_f,
+					       sum_combine_f, NULL, &sum,
+					       sizeof(sum)) == 0,
+		   "parallel reduce");
+	unit_check(sum == (uint64_t)COUNT * (COUNT - 1) / 2, "sum is correct");
+	/*
+	 * The caller does the work alone when the threads are busy.
+	 */
+	int arg = 0;
+	void *result;
+	struct thread_task *blockers[4];
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_task_new(&blockers[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, blockers[i]) != 0);
+	}
+	sum = 0;
+	unit_check(thread_pool_parallel_reduce(p, 0, COUNT, 1000, range_sum_f,
+					       sum_combine_f, NULL, &sum,
+					       sizeof(sum)) == 0,
+		   "reduce with busy pool");
+	unit_check(sum == (uint64_t)COUNT * (COUNT - 1) / 2, "sum is correct");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(thread_task_join(blockers[i], &result) != 0);
+		unit_fail_if(thread_task_delete(blockers[i]) != 0);
+	}
+	free(marks);
+	unit_check(thread_pool_delete(p) == 0, "delete right after the loops");
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_stats stats;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	unit_check(thread_pool_stats(p, NULL) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no stats");
+	unit_check(thread_pool_stats(p, &stats) == 0, "stats");
+	unit_check(stats.tasks_pushed == 0 && stats.tasks_completed == 0 &&
+		   stats.thread_count == 0, "empty stats");
+
+	enum { COUNT = 10 };
+	int arg = 0;
+	void *result;
+	struct thread_task *tasks[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	usleep(1000);
+	unit_check(thread_pool_stats(p, &stats) == 0, "stats");
+	unit_check(stats.tasks_pushed == COUNT, "pushed");
+	unit_check(stats.queue_sizes[TPOOL_PRIO_NORMAL] >= COUNT - 2 &&
+		   stats.queue_sizes[TPOOL_PRIO_NORMAL] < COUNT, "queued");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+
+	unit_check(thread_pool_stats(p, &stats) == 0, "stats");
+	unit_check(stats.tasks_completed == COUNT, "completed");
+	unit_check(stats.queue_sizes[TPOOL_PRIO_NORMAL] == 0, "queue is empty");
+	unit_check(stats.thread_count > 0 &&
+		   (uint64_t)stats.thread_count == stats.threads_created,
+		   "threads");
+	uint64_t waits = 0, runs = 0, by_workers = 0, busy = 0;
+	for (int i = 0; i < TPOOL_HIST_BUCKETS; ++i) {
+		waits += stats.wait_hist[i];
+		runs += stats.run_hist[i];
+	}
+	for (int i = 0; i < TPOOL_MAX_THREADS; ++i) {
+		by_workers += stats.workers[i].tasks_completed;
+		busy += stats.workers[i].busy_ns;
+	}
+	unit_check(waits == COUNT && runs == COUNT, "histograms");
+	unit_check(by_workers == COUNT && busy > 0, "per thread stats");
+
+	/* The idle span going on now is counted too. */
+	uint64_t idle = 0, idle_later = 0;
+	for (int i = 0; i < TPOOL_MAX_THREADS; ++i)
+		idle += stats.workers[i].idle_ns;
+	usleep(10000);
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	for (int i = 0; i < TPOOL_MAX_THREADS; ++i)
+		idle_later += stats.workers[i].idle_ns;
+	unit_check(idle_later >= idle + 10000000, "idle now");
+
+	/* A continuation run right away is still pushed. */
+	struct thread_task *next;
+	unit_fail_if(thread_task_new(&tasks[0], task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&next, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_then(tasks[0], next) != 0);
+	unit_fail_if(thread_task_join(next, &result) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_fail_if(thread_task_delete(tasks[0]) != 0);
+	unit_fail_if(thread_task_delete(next) != 0);
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(stats.tasks_pushed == COUNT + 2, "continuation is pushed");
+#if TPOOL_TRACE
+	unit_check(thread_pool_trace_write(p, "trace.json") == 0,
+		   "trace is saved");
+	remove("trace.json");
+#endif
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_until_cancelled_f(void *arg)
+{
+	struct thread_task **self = arg;
+	while (!thread_task_is_cancelled(__atomic_load_n(self, __ATOMIC_ACQUIRE)))
+		usleep(100);
+	return arg;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int flag = 0;
+	int counter = 0;
+	void *result;
+	struct thread_task *blocker, *queued, *waiting, *running;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_task_new(&queued, task_incr_f, &counter) != 0);
+	unit_fail_if(thread_task_new(&waiting, task_incr_f, &counter) != 0);
+	unit_check(thread_task_cancel(queued) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "can't cancel a not pushed task");
+	/*
+	 * The only thread is busy, so the task stays in the queue.
+	 */
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, queued) != 0);
+	unit_check(thread_task_then(queued, waiting) == 0, "waiting after queued");
+	unit_check(thread_task_cancel(queued) == 0, "cancelled a queued task");
+	unit_check(thread_task_is_finished(queued), "it is finished at once");
+	unit_check(thread_pool_queue_size(p, TPOOL_PRIO_NORMAL) == 1,
+		   "the continuation is queued instead");
+	unit_check(thread_task_join(queued, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "join reports the cancel");
+	unit_check(result == NULL, "no result");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_check(thread_task_join(waiting, &result) == 0,
+		   "the continuation is not cancelled");
+	unit_check(counter == 1, "only the continuation was run");
+	/*
+	 * A waiting task is finished without running.
+	 */
+	flag = 0;
+	counter = 0;
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_fail_if(thread_task_then(blocker, waiting) != 0);
+	unit_check(thread_task_cancel(waiting) == 0, "cancelled a waiting task");
+	unit_check(!thread_task_is_finished(waiting), "it still waits");
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_check(thread_task_join(waiting, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "waiting task is cancelled");
+	unit_check(counter == 0, "and was not run");
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_check(thread_task_cancel(blocker) == 0 &&
+		   thread_task_join(blocker, &result) == 0,
+		   "cancel of a finished task does nothing");
+	/*
+	 * A running task sees the flag.
+	 */
+	unit_fail_if(thread_task_new(&running, task_until_cancelled_f,
+				     &running) != 0);
+	unit_fail_if(thread_pool_push_task(p, running) != 0);
+	while (!thread_task_is_running(running))
+		usleep(100);
+	unit_check(!thread_task_is_cancelled(running), "not cancelled yet");
+	unit_check(thread_task_cancel(running) == 0, "cancelled a running task");
+	unit_check(thread_task_join(running, &result) == TPOOL_ERR_TASK_CANCELLED,
+		   "running task stopped");
+	unit_check(result == &running, "its result is kept");
+	/*
+	 * A pushed again task is not cancelled anymore.
+	 */
+	counter = 0;
+	unit_fail_if(thread_pool_push_task(p, queued) != 0);
+	unit_check(thread_task_join(queued, &result) == 0 && counter == 1,
+		   "reused task runs");
+
+	struct thread_pool_stats stats;
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(stats.tasks_cancelled == 2, "two tasks were dropped");
+
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_task_delete(queued) != 0);
+	unit_fail_if(thread_task_delete(waiting) != 0);
+	unit_fail_if(thread_task_delete(running) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_timed_join(void)
 {
@@ -383,6 +929,13 @@ main(int argc, char **argv)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_idle_shrink();
+	test_continuations();
+	test_priorities();
+	test_affinity();
+	test_parallel_for();
+	test_stats();
+	test_cancel();
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
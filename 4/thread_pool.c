@@ -1,16 +1,27 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "thread_pool.h"
 #include "rlist.h"
 
 #include <errno.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 enum task_status {
     TASK_NEW,
     TASK_QUEUED,
     TASK_RUNNING,
-    TASK_FINISHED
+    TASK_FINISHED,
+    /* Pushed, but waits for other tasks to finish. */
+    TASK_WAITING
 };
 
 struct thread_pool; /* forward */
@@ -21,65 +32,779 @@ struct thread_task {
     void               *result;
 
     enum task_status    status;
+    enum thread_task_priority priority;
     bool                is_detached;
     bool                is_joined;
+    /* Set by thread_task_cancel(), polled by the running function. */
+    bool                is_cancelled;
 
     struct thread_pool *pool;
     struct rlist        list;
+    /*
+     * The queue the task is pushed to. Its mutex protects the status
+     * and the dependents, the joins wait on its done_cond.
+     */
+    struct task_queue  *queue;
+    /* When the task was put into the queue, for the stats. */
+    uint64_t            queued_ns;
+
+    /* continuations */
+    struct thread_task **dependents;
+    int                 dependents_count;
+    int                 dependents_capacity;
+    /* Prerequisites not finished yet, atomic. */
+    int                 wait_count;
+};
+
+/* Anything above it is treated as an infinite timeout. */
+#define TIMEOUT_INFINITE 1e9
+
+static uint64_t
+clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Increment a counter which has only one writer. */
+static inline void
+stat_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline void
+stat_hist_add(uint64_t *hist, uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= TPOOL_HIST_BUCKETS)
+        bucket = TPOOL_HIST_BUCKETS - 1;
+    stat_add(&hist[bucket], 1);
+}
+
+static void
+deadline_after(double timeout, struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    if (timeout <= 0)
+        return;
+    deadline->tv_sec  += (time_t)timeout;
+    deadline->tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static void
+cond_init_monotonic(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * Tasks of each priority have an own FIFO. The queues are served by
+ * weighted round-robin: within one round a priority can give out at
+ * most its weight of tasks, then the next non-empty priority is
+ * served. So urgent tasks mostly go first, but the background ones
+ * still get a small fixed share and never starve.
+ */
+static const int prio_weights[TPOOL_PRIO_COUNT] = {16, 4, 1};
+
+/**
+ * A queue per NUMA node with an own lock and counters, so a push and
+ * a pop on one node touch only the cache lines of that node. The
+ * counters read by the others without the lock are atomic.
+ */
+struct task_queue {
+    pthread_mutex_t     mutex;
+    /* Wakes up the sleeping threads of the node. */
+    pthread_cond_t      task_cond;
+    /* Wakes up the joins of the tasks of the queue. */
+    pthread_cond_t      done_cond;
+    struct rlist        lists[TPOOL_PRIO_COUNT];
+    int                 sizes[TPOOL_PRIO_COUNT];
+    int                 credits[TPOOL_PRIO_COUNT];
+    /* Queued tasks. */
+    int                 size;
+    /* Tasks of the queue which run or wait for prerequisites. */
+    int                 busy_count;
+    int                 waiting_count;
+    /* Threads of the node not running a task, and those asleep. */
+    int                 idle_count;
+    int                 sleep_count;
+    uint64_t            tasks_pushed;
+    uint64_t            tasks_cancelled;
+} __attribute__((aligned(64)));
+
+static void
+task_queue_create(struct task_queue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->mutex, NULL);
+    cond_init_monotonic(&queue->task_cond);
+    cond_init_monotonic(&queue->done_cond);
+    for (int i = 0; i < TPOOL_PRIO_COUNT; ++i) {
+        rlist_create(&queue->lists[i]);
+        queue->credits[i] = prio_weights[i];
+    }
+}
+
+static void
+task_queue_destroy(struct task_queue *queue)
+{
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->task_cond);
+    pthread_cond_destroy(&queue->done_cond);
+}
+
+/** Called with the queue mutex locked. */
+static void
+task_queue_push(struct task_queue *queue, struct thread_task *task,
+                enum thread_task_priority priority)
+{
+    task->status    = TASK_QUEUED;
+    task->priority  = priority;
+    task->queued_ns = clock_ns();
+    rlist_add_tail(&queue->lists[priority], &task->list);
+    queue->sizes[priority]++;
+    queue->tasks_pushed++;
+    __atomic_add_fetch(&queue->size, 1, __ATOMIC_SEQ_CST);
+}
+
+static struct thread_task *
+task_queue_pop(struct task_queue *queue)
+{
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < TPOOL_PRIO_COUNT; ++i) {
+            if (queue->credits[i] == 0 || queue->sizes[i] == 0)
+                continue;
+            queue->credits[i]--;
+            queue->sizes[i]--;
+            __atomic_sub_fetch(&queue->size, 1, __ATOMIC_SEQ_CST);
+            return rlist_shift_entry(&queue->lists[i], struct thread_task,
+                                     list);
+        }
+        /* Everyone non-empty has spent the share, start a new round. */
+        for (int i = 0; i < TPOOL_PRIO_COUNT; ++i)
+            queue->credits[i] = prio_weights[i];
+    }
+    return NULL;
+}
+
+#if TPOOL_TRACE
+
+struct trace_event {
+    thread_task_f       function;
+    uint64_t            start_ns;
+    uint64_t            end_ns;
+};
+
+#endif
+
+enum worker_state {
+    WORKER_FREE,
+    WORKER_ALIVE
+};
+
+struct thread_worker {
+    pthread_t           thread;
+    enum worker_state   state;
+    struct thread_pool *pool;
+    /* Which of the pool queues the worker serves first. */
+    int                 node;
+#ifdef __linux__
+    bool                is_pinned;
+    cpu_set_t           cpus;
+#endif
+
+    /*
+     * Stats. Only the worker itself changes them, so there is no
+     * contention. The readers sum them up.
+     */
+    uint64_t            tasks_completed;
+    uint64_t            busy_ns;
+    uint64_t            idle_ns;
+    /*
+     * Start of the current idle span, 0 while a task runs. The span
+     * is added to idle_ns when it ends.
+     */
+    uint64_t            idle_since;
+    uint64_t            parks;
+    uint64_t            wait_hist[TPOOL_HIST_BUCKETS];
+    uint64_t            run_hist[TPOOL_HIST_BUCKETS];
+#if TPOOL_TRACE
+    /* Protected by the pool mutex. */
+    struct trace_event *events;
+    int                 events_count;
+    int                 events_capacity;
+#endif
 };
 
 struct thread_pool {
     /* threads */
-    pthread_t          *threads;
+    struct thread_worker *workers;
     int                 max_threads_count;
+    int                 min_threads_count;
+    /* Changed under the mutex, read without it. */
     int                 active_threads_count;
-    int                 idle_threads_count;
+    double              idle_timeout;
+    bool                can_shrink;
 
-    /* tasks */
-    struct rlist        task_list;
-    int                 task_list_size;
+    /* tasks, a queue per NUMA node */
+    struct task_queue  *queues;
+    int                 queue_count;
+#ifdef __linux__
+    cpu_set_t          *node_cpus;
+#endif
 
-    /* sync */
+    /* stats */
+    uint64_t            threads_created;
+    uint64_t            threads_exited;
+    uint64_t            created_ns;
+
+    /*
+     * Protects the thread slots. Is taken before the queue mutexes,
+     * and only delete holds more than one queue mutex, in order.
+     */
     pthread_mutex_t     mutex;
-    pthread_cond_t      task_cond;
-    pthread_cond_t      done_cond;
     bool                shutdown;
 };
 
-static void *
-worker_thread(void *arg)
+#ifdef __linux__
+
+enum {
+    /* Nodes above that are not used. */
+    NUMA_MAX_NODES = 64,
+};
+
+/** Parse a sysfs CPU or node list like "0-3,8,10-11". */
+static bool
+cpulist_parse(const char *str, cpu_set_t *set)
 {
-    struct thread_pool *pool = arg;
+    CPU_ZERO(set);
+    while (*str != 0 && *str != '\n') {
+        char *end;
+        long first = strtol(str, &end, 10);
+        if (end == str)
+            return false;
+        long last = first;
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str)
+                return false;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, set);
+        str = end;
+        if (*str == ',')
+            ++str;
+    }
+    return true;
+}
 
-    pthread_mutex_lock(&pool->mutex);
-    while (!pool->shutdown)
-    {
-        while (rlist_empty(&pool->task_list) && !pool->shutdown)
-            pthread_cond_wait(&pool->task_cond, &pool->mutex);
+/** Read a sysfs list file into @a set. */
+static bool
+cpulist_read(const char *path, cpu_set_t *set)
+{
+    char buf[1024];
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    bool ok = fgets(buf, sizeof(buf), f) != NULL && cpulist_parse(buf, set);
+    fclose(f);
+    return ok;
+}
 
-        if (pool->shutdown)
-            break;
+/**
+ * Read CPU sets of the NUMA nodes, only the @a allowed CPUs. Nodes
+ * without them are skipped. Returns the node count, or 0 when the
+ * topology is not known. The node ids can have gaps, like "0,2-3",
+ * the sets go one after another.
+ */
+static int
+numa_read_nodes(const cpu_set_t *allowed, cpu_set_t **node_cpus)
+{
+    cpu_set_t ids;
+    *node_cpus = NULL;
+    if (!cpulist_read("/sys/devices/system/node/online", &ids) &&
+        !cpulist_read("/sys/devices/system/node/possible", &ids))
+        return 0;
+    cpu_set_t *sets = calloc(NUMA_MAX_NODES, sizeof(cpu_set_t));
+    int count = 0;
+    for (int node = 0; node < CPU_SETSIZE && count < NUMA_MAX_NODES;
+         ++node) {
+        if (!CPU_ISSET(node, &ids))
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        /* A node with memory only gets no queue. */
+        if (!cpulist_read(path, &sets[count]))
+            continue;
+        CPU_AND(&sets[count], &sets[count], allowed);
+        if (CPU_COUNT(&sets[count]) > 0)
+            ++count;
+    }
+    if (count == 0) {
+        free(sets);
+        sets = NULL;
+    }
+    *node_cpus = sets;
+    return count;
+}
+
+static int
+numa_node_of_cpu(const struct thread_pool *pool, int cpu)
+{
+    for (int i = 0; i < pool->queue_count; ++i) {
+        if (CPU_ISSET(cpu, &pool->node_cpus[i]))
+            return i;
+    }
+    return 0;
+}
+
+/**
+ * Decide where each worker is going to run, on @a node_count nodes
+ * from pool->node_cpus. Returns the queue count.
+ */
+static int
+pool_place_workers(struct thread_pool *pool,
+                   const struct thread_pool_options *opts, int node_count)
+{
+    int queue_count = node_count > 0 ? node_count : 1;
+    /* Needed for numa_node_of_cpu() below. */
+    pool->queue_count = queue_count;
 
-        struct thread_task *task =
-            rlist_shift_entry(&pool->task_list, struct thread_task, list);
+    for (int i = 0; i < opts->max_thread_count; ++i) {
+        struct thread_worker *worker = &pool->workers[i];
+        if (opts->cpu_count > 0) {
+            int cpu = opts->cpus[i % opts->cpu_count];
+            CPU_ZERO(&worker->cpus);
+            CPU_SET(cpu, &worker->cpus);
+            worker->is_pinned = true;
+            if (node_count > 0)
+                worker->node = numa_node_of_cpu(pool, cpu);
+        } else if (node_count > 1) {
+            worker->node      = i % node_count;
+            worker->cpus      = pool->node_cpus[worker->node];
+            worker->is_pinned = true;
+        }
+    }
+    return queue_count;
+}
 
-        pool->task_list_size--;
-        pool->idle_threads_count--;
+/** The queue for tasks pushed by the current thread. */
+static struct task_queue *
+pool_local_queue(struct thread_pool *pool)
+{
+    if (pool->queue_count == 1)
+        return &pool->queues[0];
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+        return &pool->queues[0];
+    return &pool->queues[numa_node_of_cpu(pool, cpu)];
+}
+
+#else /* !__linux__ */
+
+static int
+pool_place_workers(struct thread_pool *pool,
+                   const struct thread_pool_options *opts, int node_count)
+{
+    (void)pool;
+    (void)opts;
+    (void)node_count;
+    return 1;
+}
+
+static struct task_queue *
+pool_local_queue(struct thread_pool *pool)
+{
+    return &pool->queues[0];
+}
+
+#endif /* __linux__ */
+
+/** Whether any queue has tasks. Reads no locks. */
+static bool
+pool_has_tasks(struct thread_pool *pool)
+{
+    for (int i = 0; i < pool->queue_count; ++i) {
+        if (__atomic_load_n(&pool->queues[i].size, __ATOMIC_SEQ_CST) > 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Take a task to run from the queue of the given node, or from any
+ * other if that one is empty. The thread is not idle anymore then.
+ */
+static struct thread_task *
+pool_pop_task(struct thread_pool *pool, int node)
+{
+    for (int i = 0; i < pool->queue_count; ++i) {
+        struct task_queue *queue =
+            &pool->queues[(node + i) % pool->queue_count];
+        if (__atomic_load_n(&queue->size, __ATOMIC_RELAXED) == 0)
+            continue;
+        pthread_mutex_lock(&queue->mutex);
+        struct thread_task *task = task_queue_pop(queue);
+        if (task != NULL) {
+            task->status = TASK_RUNNING;
+            queue->busy_count++;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        if (task != NULL) {
+            __atomic_sub_fetch(&pool->queues[node].idle_count, 1,
+                               __ATOMIC_SEQ_CST);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static bool
+pool_is_shutdown(struct thread_pool *pool)
+{
+    return __atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE);
+}
+
+/** End the current idle span of the thread, adding it to the stats. */
+static void
+worker_stop_idle(struct thread_worker *worker)
+{
+    uint64_t since = worker->idle_since;
+    /* Cleared first, so the stats never count it twice. */
+    __atomic_store_n(&worker->idle_since, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker->idle_ns, worker->idle_ns + clock_ns() - since,
+                     __ATOMIC_RELEASE);
+}
+
+/**
+ * Leave the pool after an idle timeout, unless the thread is needed
+ * still. Returns whether it has left.
+ */
+static bool
+worker_try_exit(struct thread_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    struct task_queue *queue = &pool->queues[worker->node];
+    pthread_mutex_lock(&pool->mutex);
+    /* Delete joins the thread then. */
+    if (pool->shutdown) {
         pthread_mutex_unlock(&pool->mutex);
+        worker_stop_idle(worker);
+        return true;
+    }
+    bool can_exit = pool->active_threads_count > pool->min_threads_count;
+    if (can_exit) {
+        __atomic_sub_fetch(&pool->active_threads_count, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&queue->idle_count, 1, __ATOMIC_SEQ_CST);
+        /* A push could see the thread here and not start a new one. */
+        if (pool_has_tasks(pool)) {
+            __atomic_add_fetch(&pool->active_threads_count, 1,
+                               __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&queue->idle_count, 1, __ATOMIC_SEQ_CST);
+            can_exit = false;
+        }
+    }
+    if (can_exit) {
+        /* The slot can be taken by a new thread right after the unlock. */
+        worker_stop_idle(worker);
+        pool->threads_exited++;
+        /*
+         * Nobody is going to join it, so the stack is given back
+         * right when the thread returns.
+         */
+        pthread_detach(pthread_self());
+        worker->state = WORKER_FREE;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return can_exit;
+}
+
+/**
+ * Sleep until a task appears in any queue. Returns false when the
+ * thread has to exit: the pool is deleted, or the thread was idle for
+ * too long and is not needed anymore.
+ */
+static bool
+worker_wait_task(struct thread_worker *worker)
+{
+    struct thread_pool *pool = worker->pool;
+    struct task_queue *queue = &pool->queues[worker->node];
+    bool is_timed_out = false;
+    pthread_mutex_lock(&queue->mutex);
+    /* A push checks it after its task is visible, no wakeup is lost. */
+    __atomic_add_fetch(&queue->sleep_count, 1, __ATOMIC_SEQ_CST);
+    while (!pool_has_tasks(pool) && !pool_is_shutdown(pool)) {
+        stat_add(&worker->parks, 1);
+        int active = __atomic_load_n(&pool->active_threads_count,
+                                     __ATOMIC_RELAXED);
+        if (!pool->can_shrink || active <= pool->min_threads_count) {
+            pthread_cond_wait(&queue->task_cond, &queue->mutex);
+            continue;
+        }
+        struct timespec deadline;
+        deadline_after(pool->idle_timeout, &deadline);
+        if (pthread_cond_timedwait(&queue->task_cond, &queue->mutex,
+                                   &deadline) == ETIMEDOUT) {
+            is_timed_out = true;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&queue->sleep_count, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue->mutex);
+    if (pool_is_shutdown(pool)) {
+        worker_stop_idle(worker);
+        return false;
+    }
+    return !is_timed_out || !worker_try_exit(worker);
+}
 
-        task->status = TASK_RUNNING;
-        task->result = task->function(task->arg);
+static void *
+worker_thread(void *arg);
 
-        pthread_mutex_lock(&pool->mutex);
-        task->status = TASK_FINISHED;
-        pool->idle_threads_count++;
+/**
+ * Start a new thread in a free slot, preferably on the given node.
+ * Called with the mutex locked.
+ */
+static void
+pool_start_worker(struct thread_pool *pool, int node)
+{
+    struct thread_worker *worker = NULL;
+    for (int i = 0; i < pool->max_threads_count; ++i) {
+        struct thread_worker *w = &pool->workers[i];
+        if (w->state == WORKER_ALIVE)
+            continue;
+        if (worker == NULL || (w->node == node && worker->node != node))
+            worker = w;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+#ifdef __linux__
+    /* Set before the start so the thread never runs anywhere else. */
+    if (worker->is_pinned)
+        pthread_attr_setaffinity_np(&attr, sizeof(worker->cpus),
+                                    &worker->cpus);
+#endif
+    int rc = pthread_create(&worker->thread, &attr, worker_thread, worker);
+    pthread_attr_destroy(&attr);
+    if (rc != 0)
+        return;
+    worker->state = WORKER_ALIVE;
+    __atomic_add_fetch(&pool->queues[worker->node].idle_count, 1,
+                       __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->active_threads_count, 1, __ATOMIC_SEQ_CST);
+    pool->threads_created++;
+}
 
-        if (task->is_detached)
-            free(task);
-        else
-            pthread_cond_broadcast(&pool->done_cond);
+/**
+ * Find a thread for a task just put into @a queue: an idle one of the
+ * queue node, of any other node, or a new one. Called without locks.
+ */
+static void
+pool_wake(struct thread_pool *pool, struct task_queue *queue)
+{
+    int first = queue - pool->queues;
+    bool has_idle = false;
+    for (int i = 0; i < pool->queue_count; ++i) {
+        struct task_queue *q = &pool->queues[(first + i) %
+                                             pool->queue_count];
+        if (__atomic_load_n(&q->idle_count, __ATOMIC_SEQ_CST) == 0)
+            continue;
+        has_idle = true;
+        if (__atomic_load_n(&q->sleep_count, __ATOMIC_SEQ_CST) == 0)
+            continue;
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_signal(&q->task_cond);
+        pthread_mutex_unlock(&q->mutex);
+        return;
     }
+    /* An idle thread which is awake looks at all the queues anyway. */
+    if (has_idle || __atomic_load_n(&pool->active_threads_count,
+                                    __ATOMIC_SEQ_CST) >=
+                    pool->max_threads_count)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->active_threads_count < pool->max_threads_count &&
+        !pool->shutdown)
+        pool_start_worker(pool, first);
     pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Put a task into its queue and find a thread for it. */
+static void
+pool_enqueue(struct thread_pool *pool, struct thread_task *task,
+             enum thread_task_priority priority, bool was_waiting)
+{
+    struct task_queue *queue = task->queue;
+    pthread_mutex_lock(&queue->mutex);
+    if (was_waiting)
+        queue->waiting_count--;
+    task_queue_push(queue, task, priority);
+    pthread_mutex_unlock(&queue->mutex);
+    pool_wake(pool, queue);
+}
+
+static void
+task_free(struct thread_task *task)
+{
+    free(task->dependents);
+    free(task);
+}
+
+/**
+ * Mark the task finished and take its dependents away, @a deps is
+ * freed by the caller. Called with the task queue mutex locked. Then
+ * a detached task is freed by the caller after the unlock.
+ */
+static int
+task_finish_locked(struct thread_task *task, struct thread_task ***deps)
+{
+    int count = task->dependents_count;
+    *deps = task->dependents;
+    task->dependents          = NULL;
+    task->dependents_count    = 0;
+    task->dependents_capacity = 0;
+    task->status = TASK_FINISHED;
+    if (!task->is_detached)
+        pthread_cond_broadcast(&task->queue->done_cond);
+    return count;
+}
+
+/**
+ * Release the tasks waiting for a finished one of @a priority. With
+ * @a can_run_next one of the released tasks is returned to be run
+ * right away by the current thread, the others are queued.
+ */
+static struct thread_task *
+task_release_deps(struct thread_pool *pool, struct thread_task **deps,
+                  int count, enum thread_task_priority priority,
+                  bool can_run_next)
+{
+    struct thread_task *next = NULL;
+    for (int i = 0; i < count; ++i) {
+        struct thread_task *dep = deps[i];
+        if (__atomic_sub_fetch(&dep->wait_count, 1, __ATOMIC_ACQ_REL) > 0)
+            continue;
+        if (next == NULL && can_run_next) {
+            next = dep;
+            struct task_queue *queue = next->queue;
+            pthread_mutex_lock(&queue->mutex);
+            next->status    = TASK_RUNNING;
+            next->priority  = priority;
+            next->queued_ns = clock_ns();
+            queue->waiting_count--;
+            queue->busy_count++;
+            /* Skips the queue, but still is a pushed task. */
+            queue->tasks_pushed++;
+            pthread_mutex_unlock(&queue->mutex);
+        } else {
+            pool_enqueue(pool, dep, priority, true);
+        }
+    }
+    free(deps);
+    return next;
+}
+
+/**
+ * Finish a task taken by the current thread and release the tasks
+ * waiting for it. One of them can be returned to be run right away.
+ */
+static struct thread_task *
+task_finish(struct thread_pool *pool, struct thread_task *task)
+{
+    struct task_queue *queue = task->queue;
+    enum thread_task_priority priority = task->priority;
+    struct thread_task **deps;
+    pthread_mutex_lock(&queue->mutex);
+    queue->busy_count--;
+    int count = task_finish_locked(task, &deps);
+    bool is_detached = task->is_detached;
+    pthread_mutex_unlock(&queue->mutex);
+    if (is_detached)
+        task_free(task);
+    return task_release_deps(pool, deps, count, priority, true);
+}
+
+#if TPOOL_TRACE
+
+/** Remember a finished task. Called with the pool mutex locked. */
+static void
+worker_trace(struct thread_worker *worker, thread_task_f function,
+             uint64_t start_ns, uint64_t end_ns)
+{
+    if (worker->events_count == worker->events_capacity) {
+        worker->events_capacity = (worker->events_capacity + 1) * 2;
+        worker->events = realloc(worker->events, sizeof(*worker->events) *
+                                 worker->events_capacity);
+    }
+    struct trace_event *e = &worker->events[worker->events_count++];
+    e->function = function;
+    e->start_ns = start_ns;
+    e->end_ns   = end_ns;
+}
+
+#endif
+
+static void *
+worker_thread(void *arg)
+{
+    struct thread_worker *worker = arg;
+    struct thread_pool *pool = worker->pool;
+    int *idle_count = &pool->queues[worker->node].idle_count;
+
+    __atomic_store_n(&worker->idle_since, clock_ns(), __ATOMIC_RELAXED);
+    while (true) {
+        struct thread_task *task = pool_pop_task(pool, worker->node);
+        if (task == NULL) {
+            if (!worker_wait_task(worker))
+                break;
+            continue;
+        }
+        /* Continuations are run by the same thread, without a queue. */
+        do {
+            if (task->is_cancelled) {
+                /* Cancelled while waiting for its prerequisites. */
+                task->result = NULL;
+                pthread_mutex_lock(&task->queue->mutex);
+                task->queue->tasks_cancelled++;
+                pthread_mutex_unlock(&task->queue->mutex);
+            } else {
+                worker_stop_idle(worker);
+                uint64_t start = clock_ns();
+                stat_hist_add(worker->wait_hist, start - task->queued_ns);
+                thread_task_f function = task->function;
+
+                task->result = function(task->arg);
+
+                uint64_t end = clock_ns();
+                stat_add(&worker->busy_ns, end - start);
+                stat_hist_add(worker->run_hist, end - start);
+                stat_add(&worker->tasks_completed, 1);
+                __atomic_store_n(&worker->idle_since, end, __ATOMIC_RELAXED);
+#if TPOOL_TRACE
+                pthread_mutex_lock(&pool->mutex);
+                worker_trace(worker, function, start, end);
+                pthread_mutex_unlock(&pool->mutex);
+#endif
+            }
+            /* Idle before the join can see the task finished. */
+            __atomic_add_fetch(idle_count, 1, __ATOMIC_SEQ_CST);
+            task = task_finish(pool, task);
+            if (task != NULL)
+                __atomic_sub_fetch(idle_count, 1, __ATOMIC_SEQ_CST);
+        } while (task != NULL);
+    }
     return NULL;
 }
 
@@ -87,17 +812,67 @@ worker_thread(void *arg)
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool)
 {
-    if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS)
+    struct thread_pool_options opts = {
+        .max_thread_count = max_thread_count,
+        .min_thread_count = 0,
+        .idle_timeout     = INFINITY,
+    };
+    return thread_pool_new_ex(&opts, pool);
+}
+
+int
+thread_pool_new_ex(const struct thread_pool_options *opts,
+                   struct thread_pool **pool)
+{
+    if (!opts || opts->max_thread_count <= 0 ||
+        opts->max_thread_count > TPOOL_MAX_THREADS ||
+        opts->min_thread_count < 0 ||
+        opts->min_thread_count > opts->max_thread_count ||
+        !(opts->idle_timeout >= 0) || opts->cpu_count < 0 ||
+        (opts->cpu_count > 0 && opts->cpus == NULL))
         return TPOOL_ERR_INVALID_ARGUMENT;
+    int node_count = 0;
+#ifdef __linux__
+    cpu_set_t allowed;
+    if ((opts->cpu_count > 0 || opts->numa_aware) &&
+        sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    for (int i = 0; i < opts->cpu_count; ++i) {
+        int cpu = opts->cpus[i];
+        if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))
+            return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    cpu_set_t *node_cpus = NULL;
+    if (opts->numa_aware &&
+        (node_count = numa_read_nodes(&allowed, &node_cpus)) == 0)
+        return TPOOL_ERR_NOT_IMPLEMENTED;
+#else
+    if (opts->cpu_count > 0 || opts->numa_aware)
+        return TPOOL_ERR_NOT_IMPLEMENTED;
+#endif
 
     *pool                      = calloc(1, sizeof(struct thread_pool));
-    (*pool)->threads           = calloc(max_thread_count, sizeof(pthread_t));
-    (*pool)->max_threads_count = max_thread_count;
+    (*pool)->workers           = calloc(opts->max_thread_count,
+                                        sizeof(struct thread_worker));
+    (*pool)->max_threads_count = opts->max_thread_count;
+    (*pool)->min_threads_count = opts->min_thread_count;
+    (*pool)->idle_timeout      = opts->idle_timeout;
+    (*pool)->can_shrink        = opts->idle_timeout < TIMEOUT_INFINITE;
+    for (int i = 0; i < opts->max_thread_count; ++i)
+        (*pool)->workers[i].pool = *pool;
+    (*pool)->created_ns = clock_ns();
+#ifdef __linux__
+    (*pool)->node_cpus = node_cpus;
+#endif
 
-    rlist_create(&(*pool)->task_list);
-    pthread_mutex_init(&(*pool)->mutex,     NULL);
-    pthread_cond_init (&(*pool)->task_cond, NULL);
-    pthread_cond_init (&(*pool)->done_cond, NULL);
+    (*pool)->queue_count = pool_place_workers(*pool, opts, node_count);
+    /* Each queue on own cache lines. */
+    (*pool)->queues      = aligned_alloc(_Alignof(struct task_queue),
+                                         (*pool)->queue_count *
+                                         sizeof(struct task_queue));
+    for (int i = 0; i < (*pool)->queue_count; ++i)
+        task_queue_create(&(*pool)->queues[i]);
+    pthread_mutex_init(&(*pool)->mutex, NULL);
     return 0;
 }
 
@@ -106,61 +881,201 @@ thread_pool_thread_count(const struct thread_pool *pool)
 {
     if (!pool)
         return TPOOL_ERR_INVALID_ARGUMENT;
-    return pool->active_threads_count;
+    return __atomic_load_n(&pool->active_threads_count, __ATOMIC_RELAXED);
 }
 
+int
+thread_pool_queue_size(const struct thread_pool *pool,
+                       enum thread_task_priority priority)
+{
+    if (!pool || priority < 0 || priority >= TPOOL_PRIO_COUNT)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    int size = 0;
+    for (int i = 0; i < pool->queue_count; ++i)
+        size += __atomic_load_n(&pool->queues[i].sizes[priority],
+                                __ATOMIC_RELAXED);
+    return size;
+}
+
+int
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats)
+{
+    if (!pool || !stats)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&pool->mutex);
+    stats->thread_count    = pool->active_threads_count;
+    stats->threads_created = pool->threads_created;
+    stats->threads_exited  = pool->threads_exited;
+    for (int i = 0; i < pool->queue_count; ++i) {
+        struct task_queue *queue = &pool->queues[i];
+        pthread_mutex_lock(&queue->mutex);
+        stats->tasks_pushed    += queue->tasks_pushed;
+        stats->tasks_cancelled += queue->tasks_cancelled;
+        for (int prio = 0; prio < TPOOL_PRIO_COUNT; ++prio)
+            stats->queue_sizes[prio] += queue->sizes[prio];
+        pthread_mutex_unlock(&queue->mutex);
+    }
+    uint64_t now = clock_ns();
+    for (int i = 0; i < pool->max_threads_count; ++i) {
+        const struct thread_worker *worker = &pool->workers[i];
+        struct thread_pool_worker_stats *ws = &stats->workers[i];
+        ws->is_alive        = worker->state == WORKER_ALIVE;
+        ws->tasks_completed = __atomic_load_n(&worker->tasks_completed,
+                                              __ATOMIC_RELAXED);
+        ws->busy_ns         = __atomic_load_n(&worker->busy_ns,
+                                              __ATOMIC_RELAXED);
+        ws->idle_ns         = __atomic_load_n(&worker->idle_ns,
+                                              __ATOMIC_ACQUIRE);
+        /* The span going on now is not added yet. */
+        uint64_t since = __atomic_load_n(&worker->idle_since,
+                                         __ATOMIC_RELAXED);
+        if (ws->is_alive && since != 0 && now > since)
+            ws->idle_ns += now - since;
+        ws->parks           = __atomic_load_n(&worker->parks,
+                                              __ATOMIC_RELAXED);
+        for (int b = 0; b < TPOOL_HIST_BUCKETS; ++b) {
+            stats->wait_hist[b] += __atomic_load_n(&worker->wait_hist[b],
+                                                   __ATOMIC_RELAXED);
+            stats->run_hist[b]  += __atomic_load_n(&worker->run_hist[b],
+                                                   __ATOMIC_RELAXED);
+        }
+        stats->tasks_completed += ws->tasks_completed;
+        stats->threads_parked  += ws->parks;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+#if TPOOL_TRACE
+
+int
+thread_pool_trace_write(struct thread_pool *pool, const char *path)
+{
+    if (!pool || !path)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    fprintf(f, "{\"traceEvents\":[");
+    bool is_first = true;
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < pool->max_threads_count; ++i) {
+        const struct thread_worker *worker = &pool->workers[i];
+        for (int j = 0; j < worker->events_count; ++j) {
+            const struct trace_event *e = &worker->events[j];
+            fprintf(f, "%s\n{\"name\":\"%p\",\"cat\":\"task\","
+                    "\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", is_first ? "" : ",",
+                    (void *)(uintptr_t)e->function, i,
+                    (e->start_ns - pool->created_ns) / 1000.0,
+                    (e->end_ns - e->start_ns) / 1000.0);
+            is_first = false;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0 ? 0 : TPOOL_ERR_INVALID_ARGUMENT;
+}
+
+#endif /* TPOOL_TRACE */
+
 int
 thread_pool_delete(struct thread_pool *pool)
 {
     if (!pool)
         return TPOOL_ERR_INVALID_ARGUMENT;
 
-    if (!rlist_empty(&pool->task_list) ||
-        pool->idle_threads_count != pool->active_threads_count)
+    /* Delete is rare, it can stop all the queues at once. */
+    pthread_mutex_lock(&pool->mutex);
+    bool has_tasks = false;
+    for (int i = 0; i < pool->queue_count; ++i) {
+        struct task_queue *queue = &pool->queues[i];
+        pthread_mutex_lock(&queue->mutex);
+        has_tasks = has_tasks || queue->size != 0 ||
+                    queue->busy_count != 0 || queue->waiting_count != 0;
+    }
+    if (!has_tasks)
+        __atomic_store_n(&pool->shutdown, true, __ATOMIC_RELEASE);
+    for (int i = 0; i < pool->queue_count; ++i) {
+        pthread_cond_broadcast(&pool->queues[i].task_cond);
+        pthread_mutex_unlock(&pool->queues[i].mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (has_tasks)
         return TPOOL_ERR_HAS_TASKS;
 
-    pool->shutdown = true;
-    pthread_cond_broadcast(&pool->task_cond);
-
-    for (int i = 0; i < pool->active_threads_count; ++i)
-        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < pool->max_threads_count; ++i) {
+        if (pool->workers[i].state != WORKER_FREE)
+            pthread_join(pool->workers[i].thread, NULL);
+    }
 
     pthread_mutex_destroy(&pool->mutex);
-    pthread_cond_destroy(&pool->task_cond);
-    pthread_cond_destroy(&pool->done_cond);
+    for (int i = 0; i < pool->queue_count; ++i)
+        task_queue_destroy(&pool->queues[i]);
 
-    free(pool->threads);
+#ifdef __linux__
+    free(pool->node_cpus);
+#endif
+#if TPOOL_TRACE
+    for (int i = 0; i < pool->max_threads_count; ++i)
+        free(pool->workers[i].events);
+#endif
+    free(pool->queues);
+    free(pool->workers);
     free(pool);
     return 0;
 }
 
+/** Whether the task is queued, running or waiting in a pool. */
+static bool
+task_is_in_pool(struct thread_task *task)
+{
+    struct task_queue *queue = task->queue;
+    if (queue == NULL)
+        return false;
+    pthread_mutex_lock(&queue->mutex);
+    bool res = task->status == TASK_QUEUED || task->status == TASK_RUNNING ||
+               task->status == TASK_WAITING;
+    pthread_mutex_unlock(&queue->mutex);
+    return res;
+}
+
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 {
-    if (!pool || !task || pool->shutdown)
-        return TPOOL_ERR_INVALID_ARGUMENT;
+    return thread_pool_push_task_prio(pool, task, TPOOL_PRIO_NORMAL);
+}
 
-    pthread_mutex_lock(&pool->mutex);
+int
+thread_pool_push_task_prio(struct thread_pool *pool, struct thread_task *task,
+                           enum thread_task_priority priority)
+{
+    if (!pool || !task || pool_is_shutdown(pool) ||
+        priority < 0 || priority >= TPOOL_PRIO_COUNT)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (task_is_in_pool(task))
+        return TPOOL_ERR_TASK_IN_POOL;
 
-    if (pool->task_list_size >= TPOOL_MAX_TASKS) {
-        pthread_mutex_unlock(&pool->mutex);
+    struct task_queue *queue = pool_local_queue(pool);
+    pthread_mutex_lock(&queue->mutex);
+    /* Other queues are read without their locks, exact on one node. */
+    int size = 0;
+    for (int i = 0; i < pool->queue_count; ++i)
+        size += __atomic_load_n(&pool->queues[i].size, __ATOMIC_RELAXED);
+    if (size >= TPOOL_MAX_TASKS) {
+        pthread_mutex_unlock(&queue->mutex);
         return TPOOL_ERR_TOO_MANY_TASKS;
     }
-
-    task->pool   = pool;
-    task->status = TASK_QUEUED;
-    rlist_add_tail(&pool->task_list, &task->list);
-    pool->task_list_size++;
-
-    if (pool->idle_threads_count == 0 &&
-        pool->active_threads_count < pool->max_threads_count) {
-        if (pthread_create(&pool->threads[pool->active_threads_count++],
-                           NULL, worker_thread, pool) == 0)
-            pool->idle_threads_count++;
-    }
-
-    pthread_cond_signal(&pool->task_cond);
-    pthread_mutex_unlock(&pool->mutex);
+    task->pool         = pool;
+    task->queue        = queue;
+    task->is_joined    = false;
+    task->is_cancelled = false;
+    task_queue_push(queue, task, priority);
+    pthread_mutex_unlock(&queue->mutex);
+    pool_wake(pool, queue);
     return 0;
 }
 
@@ -200,14 +1115,16 @@ thread_task_join(struct thread_task *task, void **result)
     if (task->status == TASK_NEW)
         return TPOOL_ERR_TASK_NOT_PUSHED;
 
-    pthread_mutex_lock(&task->pool->mutex);
+    struct task_queue *queue = task->queue;
+    pthread_mutex_lock(&queue->mutex);
     while (task->status != TASK_FINISHED)
-        pthread_cond_wait(&task->pool->done_cond, &task->pool->mutex);
+        pthread_cond_wait(&queue->done_cond, &queue->mutex);
 
     *result        = task->result;
     task->is_joined = true;
-    pthread_mutex_unlock(&task->pool->mutex);
-    return 0;
+    bool is_cancelled = task->is_cancelled;
+    pthread_mutex_unlock(&queue->mutex);
+    return is_cancelled ? TPOOL_ERR_TASK_CANCELLED : 0;
 }
 
 #if NEED_TIMED_JOIN
@@ -221,35 +1138,26 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
         return TPOOL_ERR_TASK_NOT_PUSHED;
 
     struct timespec timeout_time;
-    if (clock_gettime(CLOCK_MONOTONIC, &timeout_time) != 0)
-        return -1;
-
-    timeout_time.tv_sec  += (time_t)timeout;
-    timeout_time.tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    if (timeout > TIMEOUT_INFINITE)
+        timeout = TIMEOUT_INFINITE;
+    deadline_after(timeout, &timeout_time);
 
-    pthread_mutex_lock(&task->pool->mutex);
+    struct task_queue *queue = task->queue;
+    pthread_mutex_lock(&queue->mutex);
     int wait_result = 0;
     while (task->status != TASK_FINISHED && wait_result != ETIMEDOUT) {
-        pthread_cond_timedwait(&task->pool->done_cond,
-                               &task->pool->mutex, &timeout_time);
-
-        if (wait_result != ETIMEDOUT) {
-            struct timespec now;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-            if (now.tv_sec  > timeout_time.tv_sec ||
-                (now.tv_sec == timeout_time.tv_sec &&
-                 now.tv_nsec >= timeout_time.tv_nsec))
-                wait_result = ETIMEDOUT;
-        }
+        wait_result = pthread_cond_timedwait(&queue->done_cond,
+                                             &queue->mutex, &timeout_time);
     }
 
     if (task->status == TASK_FINISHED) {
         *result        = task->result;
         task->is_joined = true;
-        pthread_mutex_unlock(&task->pool->mutex);
-        return 0;
+        bool is_cancelled = task->is_cancelled;
+        pthread_mutex_unlock(&queue->mutex);
+        return is_cancelled ? TPOOL_ERR_TASK_CANCELLED : 0;
     }
-    pthread_mutex_unlock(&task->pool->mutex);
+    pthread_mutex_unlock(&queue->mutex);
     return TPOOL_ERR_TIMEOUT;
 }
 #endif /* NEED_TIMED_JOIN */
@@ -263,7 +1171,64 @@ thread_task_delete(struct thread_task *task)
     if (task->status != TASK_NEW && !task->is_joined)
         return TPOOL_ERR_TASK_IN_POOL;
 
-    free(task);
+    task_free(task);
+    return 0;
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next)
+{
+    return thread_task_when_all(&task, 1, next);
+}
+
+int
+thread_task_when_all(struct thread_task **tasks, int count,
+                     struct thread_task *next)
+{
+    if (!tasks || count <= 0 || !next)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    for (int i = 0; i < count; ++i) {
+        if (!tasks[i] || tasks[i] == next)
+            return TPOOL_ERR_INVALID_ARGUMENT;
+        if (tasks[i]->status == TASK_NEW)
+            return TPOOL_ERR_TASK_NOT_PUSHED;
+        if (tasks[i]->pool != tasks[0]->pool)
+            return TPOOL_ERR_INVALID_ARGUMENT;
+    }
+    struct thread_pool *pool = tasks[0]->pool;
+    if (task_is_in_pool(next))
+        return TPOOL_ERR_TASK_IN_POOL;
+
+    struct task_queue *queue = pool_local_queue(pool);
+    next->pool         = pool;
+    next->queue        = queue;
+    next->is_joined    = false;
+    next->is_cancelled = false;
+    /* One more for the registration, so nobody releases it meanwhile. */
+    next->wait_count   = 1;
+    pthread_mutex_lock(&queue->mutex);
+    next->status = TASK_WAITING;
+    queue->waiting_count++;
+    pthread_mutex_unlock(&queue->mutex);
+
+    for (int i = 0; i < count; ++i) {
+        struct thread_task *t = tasks[i];
+        pthread_mutex_lock(&t->queue->mutex);
+        if (t->status != TASK_FINISHED) {
+            if (t->dependents_count == t->dependents_capacity) {
+                t->dependents_capacity = (t->dependents_capacity + 1) * 2;
+                t->dependents = realloc(t->dependents,
+                                        sizeof(*t->dependents) *
+                                        t->dependents_capacity);
+            }
+            t->dependents[t->dependents_count++] = next;
+            __atomic_add_fetch(&next->wait_count, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&t->queue->mutex);
+    }
+    if (__atomic_sub_fetch(&next->wait_count, 1, __ATOMIC_ACQ_REL) == 0)
+        pool_enqueue(pool, next, tasks[0]->priority, true);
     return 0;
 }
 
@@ -277,11 +1242,11 @@ thread_task_detach(struct thread_task *task)
     if (task->status == TASK_NEW)
         return TPOOL_ERR_TASK_NOT_PUSHED;
 
-    pthread_mutex_t *mutex = &task->pool->mutex;
+    pthread_mutex_t *mutex = &task->queue->mutex;
     pthread_mutex_lock(mutex);
 
     if (task->status == TASK_FINISHED)
-        free(task);
+        task_free(task);
     else
         task->is_detached = true;
 
@@ -289,3 +1254,307 @@ thread_task_detach(struct thread_task *task)
     return 0;
 }
 #endif /* NEED_DETACH */
+
+int
+thread_task_cancel(struct thread_task *task)
+{
+    if (!task)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    if (task->status == TASK_NEW)
+        return TPOOL_ERR_TASK_NOT_PUSHED;
+
+    struct task_queue *queue = task->queue;
+    pthread_mutex_lock(&queue->mutex);
+    switch (task->status) {
+    case TASK_QUEUED: {
+        rlist_del(&task->list);
+        queue->sizes[task->priority]--;
+        __atomic_sub_fetch(&queue->size, 1, __ATOMIC_SEQ_CST);
+        queue->tasks_cancelled++;
+        task->is_cancelled = true;
+        task->result       = NULL;
+        struct thread_pool *pool = task->pool;
+        enum thread_task_priority priority = task->priority;
+        struct thread_task **deps;
+        int count = task_finish_locked(task, &deps);
+        bool is_detached = task->is_detached;
+        pthread_mutex_unlock(&queue->mutex);
+        if (is_detached)
+            task_free(task);
+        /* Nobody runs the continuations inline here, queue them all. */
+        task_release_deps(pool, deps, count, priority, false);
+        return 0;
+    }
+    case TASK_RUNNING:
+        __atomic_store_n(&task->is_cancelled, true, __ATOMIC_RELAXED);
+        break;
+    case TASK_WAITING:
+        /* Is finished without running once the prerequisites are. */
+        task->is_cancelled = true;
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+bool
+thread_task_is_cancelled(const struct thread_task *task)
+{
+    if (!task)
+        return false;
+    return __atomic_load_n(&task->is_cancelled, __ATOMIC_RELAXED);
+}
+
+/** Parallel loops. */
+
+/** A part of the loop range owned by one participant. */
+struct range_slot {
+    pthread_mutex_t     mutex;
+    size_t              begin;
+    size_t              end;
+    void               *acc;
+    /* The task pushed to help, joined by the caller. */
+    struct thread_task *helper;
+};
+
+struct range_job {
+    thread_range_f      for_fn;
+    thread_reduce_f     reduce_fn;
+    void               *ctx;
+    size_t              grain;
+
+    /* Iterations not processed yet. */
+    size_t              remaining;
+    /* Slots given to participants. */
+    int                 next_slot;
+    int                 slot_count;
+    struct range_slot   slots[];
+};
+
+/**
+ * Wait for a helper task to finish. One which is still queued is not
+ * needed anymore, the caller is done, so it is taken out unrun.
+ */
+static void
+range_helper_join(struct thread_task *task)
+{
+    struct task_queue *queue = task->queue;
+    pthread_mutex_lock(&queue->mutex);
+    if (task->status == TASK_QUEUED) {
+        rlist_del(&task->list);
+        queue->sizes[task->priority]--;
+        __atomic_sub_fetch(&queue->size, 1, __ATOMIC_SEQ_CST);
+        task->status = TASK_FINISHED;
+    }
+    while (task->status != TASK_FINISHED)
+        pthread_cond_wait(&queue->done_cond, &queue->mutex);
+    pthread_mutex_unlock(&queue->mutex);
+    task_free(task);
+}
+
+/** Take up to grain iterations from the front of own range. */
+static bool
+range_slot_pop(struct range_slot *slot, size_t grain, size_t *begin,
+               size_t *end)
+{
+    pthread_mutex_lock(&slot->mutex);
+    bool ok = slot->begin < slot->end;
+    if (ok) {
+        *begin = slot->begin;
+        *end = slot->end - slot->begin > grain ? slot->begin + grain :
+                                                 slot->end;
+        __atomic_store_n(&slot->begin, *end, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slot->mutex);
+    return ok;
+}
+
+/**
+ * Steal the upper half of the biggest range of the others. A range
+ * not bigger than grain is taken whole.
+ */
+static bool
+range_job_steal(struct range_job *job, int self, size_t *begin, size_t *end)
+{
+    while (__atomic_load_n(&job->remaining, __ATOMIC_ACQUIRE) > 0) {
+        struct range_slot *victim = NULL;
+        size_t victim_size = 0;
+        for (int i = 0; i < job->slot_count; ++i) {
+            struct range_slot *slot = &job->slots[i];
+            if (i == self)
+                continue;
+            /* A racy estimate, rechecked under the lock. */
+            size_t b = __atomic_load_n(&slot->begin, __ATOMIC_RELAXED);
+            size_t e = __atomic_load_n(&slot->end, __ATOMIC_RELAXED);
+            if (b < e && e - b > victim_size) {
+                victim = slot;
+                victim_size = e - b;
+            }
+        }
+        if (victim == NULL)
+            return false;
+        pthread_mutex_lock(&victim->mutex);
+        bool ok = victim->begin < victim->end;
+        if (ok) {
+            size_t size = victim->end - victim->begin;
+            *end = victim->end;
+            *begin = size > job->grain ? victim->end - size / 2 :
+                                         victim->begin;
+            __atomic_store_n(&victim->end, *begin, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&victim->mutex);
+        if (ok)
+            return true;
+    }
+    return false;
+}
+
+static void
+range_job_run(struct range_job *job, int self)
+{
+    struct range_slot *slot = &job->slots[self];
+    size_t begin, end;
+    while (true) {
+        if (!range_slot_pop(slot, job->grain, &begin, &end)) {
+            if (!range_job_steal(job, self, &begin, &end))
+                return;
+            pthread_mutex_lock(&slot->mutex);
+            __atomic_store_n(&slot->begin, begin, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->end, end, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&slot->mutex);
+            continue;
+        }
+        if (job->for_fn != NULL)
+            job->for_fn(begin, end, job->ctx);
+        else
+            job->reduce_fn(begin, end, slot->acc, job->ctx);
+        if (__atomic_sub_fetch(&job->remaining, end - begin,
+                               __ATOMIC_ACQ_REL) == 0)
+            return;
+    }
+}
+
+static void *
+range_helper_f(void *arg)
+{
+    struct range_job *job = arg;
+    int self = __atomic_fetch_add(&job->next_slot, 1, __ATOMIC_RELAXED);
+    if (self < job->slot_count)
+        range_job_run(job, self);
+    return NULL;
+}
+
+static int
+range_job_execute(struct thread_pool *pool, size_t begin, size_t end,
+                  size_t grain, thread_range_f for_fn,
+                  thread_reduce_f reduce_fn, thread_combine_f combine,
+                  void *ctx, void *result, size_t result_size)
+{
+    if (begin >= end)
+        return 0;
+    if (grain == 0)
+        grain = 1;
+    /* Rounded up without an overflow for a huge grain. */
+    size_t n = end - begin;
+    size_t parts = n / grain + (n % grain != 0);
+    int slot_count = pool->max_threads_count + 1;
+    if ((size_t)slot_count > parts)
+        slot_count = (int)parts;
+    if (slot_count < 1)
+        slot_count = 1;
+
+    /* The accumulator copies are right after the slots. */
+    size_t acc_offset = sizeof(struct range_job) +
+                        slot_count * sizeof(struct range_slot);
+    acc_offset = (acc_offset + 15) & ~(size_t)15;
+    size_t acc_step = (result_size + 15) & ~(size_t)15;
+    struct range_job *job = malloc(acc_offset + slot_count * acc_step);
+    if (job == NULL) {
+        /* Still can do it all alone. */
+        if (for_fn != NULL)
+            for_fn(begin, end, ctx);
+        else
+            reduce_fn(begin, end, result, ctx);
+        return 0;
+    }
+    job->for_fn     = for_fn;
+    job->reduce_fn  = reduce_fn;
+    job->ctx        = ctx;
+    job->grain      = grain;
+    job->remaining  = end - begin;
+    /* Slot 0 is the caller's. */
+    job->next_slot  = 1;
+    job->slot_count = slot_count;
+    for (int i = 0; i < slot_count; ++i) {
+        struct range_slot *slot = &job->slots[i];
+        pthread_mutex_init(&slot->mutex, NULL);
+        slot->begin  = 0;
+        slot->end    = 0;
+        slot->acc    = NULL;
+        slot->helper = NULL;
+        if (i == 0) {
+            slot->acc = result;
+        } else if (result != NULL) {
+            slot->acc = (char *)job + acc_offset + i * acc_step;
+            memcpy(slot->acc, result, result_size);
+        }
+    }
+    /* The others get their parts by stealing from the caller. */
+    job->slots[0].begin = begin;
+    job->slots[0].end   = end;
+
+    for (int i = 1; i < slot_count; ++i) {
+        struct thread_task *task;
+        thread_task_new(&task, range_helper_f, job);
+        if (thread_pool_push_task(pool, task) != 0) {
+            task_free(task);
+            break;
+        }
+        job->slots[i].helper = task;
+    }
+
+    range_job_run(job, 0);
+    /*
+     * Each part is done by whoever took it, so the range is done
+     * once all the helpers are. Then nothing touches the job or the
+     * pool on its behalf anymore.
+     */
+    for (int i = 1; i < slot_count; ++i) {
+        if (job->slots[i].helper != NULL)
+            range_helper_join(job->slots[i].helper);
+    }
+
+    if (combine != NULL) {
+        for (int i = 1; i < slot_count; ++i)
+            combine(result, job->slots[i].acc, ctx);
+    }
+    for (int i = 0; i < slot_count; ++i)
+        pthread_mutex_destroy(&job->slots[i].mutex);
+    free(job);
+    return 0;
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+                         size_t grain, thread_range_f fn, void *ctx)
+{
+    if (!pool || !fn)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    return range_job_execute(pool, begin, end, grain, fn, NULL, NULL, ctx,
+                             NULL, 0);
+}
+
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin,
+                            size_t end, size_t grain, thread_reduce_f fn,
+                            thread_combine_f combine, void *ctx, void *result,
+                            size_t result_size)
+{
+    if (!pool || !fn || !combine || !result || result_size == 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    return range_job_execute(pool, begin, end, grain, NULL, fn, combine, ctx,
+                             result, result_size);
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -18,6 +20,15 @@
 #define NEED_DETACH 1
 #define NEED_TIMED_JOIN 1
 
+/**
+ * Build with -DTPOOL_TRACE=1 to record start and end of each task.
+ * The records can be saved via thread_pool_trace_write() in Chrome
+ * trace format, and opened in chrome://tracing or Perfetto.
+ */
+#ifndef TPOOL_TRACE
+#define TPOOL_TRACE 0
+#endif
+
 struct thread_pool;
 struct thread_task;
 
@@ -26,6 +37,19 @@ typedef void *(*thread_task_f)(void *);
 enum {
 	TPOOL_MAX_THREADS = 20,
 	TPOOL_MAX_TASKS = 100000,
+	TPOOL_HIST_BUCKETS = 32,
+};
+
+/**
+ * Task priorities, from the most urgent to the least. The pool
+ * prefers the urgent tasks, but the others still get a small share
+ * of the threads and can't starve.
+ */
+enum thread_task_priority {
+	TPOOL_PRIO_HIGH,
+	TPOOL_PRIO_NORMAL,
+	TPOOL_PRIO_LOW,
+	TPOOL_PRIO_COUNT,
 };
 
 enum thread_poool_errcode {
@@ -36,6 +60,7 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
 	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_TASK_CANCELLED,
 };
 
 /** Thread pool API. */
@@ -54,6 +79,59 @@ enum thread_poool_errcode {
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
+/** Settings for thread_pool_new_ex(). */
+struct thread_pool_options {
+	/** Maximum pool size. The same limits as in thread_pool_new(). */
+	int max_thread_count;
+	/**
+	 * How many threads are kept alive regardless of being idle. Can't
+	 * be bigger than max_thread_count.
+	 */
+	int min_thread_count;
+	/**
+	 * Timeout in seconds after which an idle thread above
+	 * min_thread_count exits. For keeping the threads forever pass
+	 * infinity or DBL_MAX or just something huge.
+	 */
+	double idle_timeout;
+	/**
+	 * CPUs to pin the threads to. Each thread is pinned to one CPU,
+	 * they are assigned round-robin. NULL with 0 count means no
+	 * pinning.
+	 */
+	const int *cpus;
+	int cpu_count;
+	/**
+	 * Keep a task queue per NUMA node. A task is put into the queue
+	 * of the node where the pushing thread runs, and the threads of
+	 * that node take it first. Without the explicit @a cpus the
+	 * threads are spread over the nodes evenly. Only the CPUs the
+	 * process is allowed to run on are counted. A machine without
+	 * NUMA is one node and gets one queue.
+	 */
+	bool numa_aware;
+};
+
+/**
+ * Create a new thread pool with the given options. Threads are
+ * still started gradually, when needed. But they are also stopped
+ * when there is no work for them for too long.
+ * @param opts Pool options.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or min_thread_count is out of [0, max_thread_count],
+ *       or idle_timeout is negative, or a CPU number is invalid.
+ *     - TPOOL_ERR_NOT_IMPLEMENTED - CPU pinning or NUMA awareness
+ *       is requested, but isn't supported on this system, or the
+ *       NUMA topology can't be read.
+ */
+int
+thread_pool_new_ex(const struct thread_pool_options *opts,
+		   struct thread_pool **pool);
+
 /**
  * How many threads are created by this pool. Can be less than
  * max.
@@ -63,6 +141,77 @@ thread_pool_new(int max_thread_count, struct thread_pool **pool);
 int
 thread_pool_thread_count(const struct thread_pool *pool);
 
+/** Counters of one pool thread slot. */
+struct thread_pool_worker_stats {
+	/** Whether the slot has a running thread now. */
+	bool is_alive;
+	/** Tasks finished by the threads of this slot. */
+	uint64_t tasks_completed;
+	/** Nanoseconds spent in the task functions. */
+	uint64_t busy_ns;
+	/** Nanoseconds spent between the tasks. */
+	uint64_t idle_ns;
+	/** How many times the thread went to sleep waiting for tasks. */
+	uint64_t parks;
+};
+
+/**
+ * Pool counters since its creation. Histogram bucket i counts the
+ * durations in [2^i, 2^(i+1)) nanoseconds, the last bucket also
+ * counts everything longer.
+ */
+struct thread_pool_stats {
+	uint64_t tasks_pushed;
+	uint64_t tasks_completed;
+	/** Tasks dropped by cancel before they could start. */
+	uint64_t tasks_cancelled;
+	/** Tasks in the queue now, per priority. */
+	int queue_sizes[TPOOL_PRIO_COUNT];
+	/** Threads running now. */
+	int thread_count;
+	uint64_t threads_created;
+	/** Threads stopped for being idle too long. */
+	uint64_t threads_exited;
+	uint64_t threads_parked;
+	/** Time from a push to the task start. */
+	uint64_t wait_hist[TPOOL_HIST_BUCKETS];
+	/** Task run time. */
+	uint64_t run_hist[TPOOL_HIST_BUCKETS];
+	struct thread_pool_worker_stats workers[TPOOL_MAX_THREADS];
+};
+
+/**
+ * Collect the pool counters. The threads keep their own counters,
+ * so counting is cheap and they are summed up only here.
+ * @param pool Thread pool to get the stats of.
+ * @param[out] stats Pointer to store the stats.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool or no stats.
+ */
+int
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats);
+
+#if TPOOL_TRACE
+
+/**
+ * Save the recorded task events into a file as Chrome trace JSON.
+ * Each pool thread slot is a separate track, the events are named
+ * by the task function address.
+ * @param pool Thread pool to save the events of.
+ * @param path File to write.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool, or the file can't be
+ *       written.
+ */
+int
+thread_pool_trace_write(struct thread_pool *pool, const char *path);
+
+#endif
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
@@ -73,6 +222,16 @@ thread_pool_thread_count(const struct thread_pool *pool);
 int
 thread_pool_delete(struct thread_pool *pool);
 
+/**
+ * How many tasks of the given priority wait in the queue.
+ * @param pool Thread pool to get the queue size of.
+ * @param priority Priority to count the tasks of.
+ * @retval Task count.
+ */
+int
+thread_pool_queue_size(const struct thread_pool *pool,
+		       enum thread_task_priority priority);
+
 /**
  * Push @a task into thread pool queue.
  * @param pool Pool to push into.
@@ -82,10 +241,32 @@ thread_pool_delete(struct thread_pool *pool);
  * @retval != Error code.
  *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
  *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is already pushed and
+ *       is not finished yet.
  */
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Like thread_pool_push_task(), but with a priority other than
+ * TPOOL_PRIO_NORMAL. Continuations of the task are queued with the
+ * same priority.
+ * @param pool Pool to push into.
+ * @param task Task to push.
+ * @param priority Priority of @a task.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - unknown priority.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is already pushed and
+ *       is not finished yet.
+ */
+int
+thread_pool_push_task_prio(struct thread_pool *pool, struct thread_task *task,
+			   enum thread_task_priority priority);
+
 /** Thread pool task API. */
 
 /**
@@ -123,6 +304,9 @@ thread_task_is_running(const struct thread_task *task);
  * @retval 0 Success.
  * @retval != 0 Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_TASK_CANCELLED - task was cancelled. It is joined,
+ *       the result is NULL if it did not start or whatever its
+ *       function returned.
  */
 int
 thread_task_join(struct thread_task *task, void **result);
@@ -140,6 +324,8 @@ thread_task_join(struct thread_task *task, void **result);
  * @retval != 0 Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
  *     - TPOOL_ERR_TIMEOUT - join timed out, nothing is done.
+ *     - TPOOL_ERR_TASK_CANCELLED - task was cancelled, see
+ *       thread_task_join().
  */
 int
 thread_task_timed_join(struct thread_task *task, double timeout, void **result);
@@ -158,6 +344,43 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result);
 int
 thread_task_delete(struct thread_task *task);
 
+/**
+ * Push @a next into the pool of @a task when @a task is finished.
+ * The thread which finished @a task can run @a next right away,
+ * without putting it into the queue. Right after the call @a next
+ * counts as pushed: it can be joined, detached, but can't be pushed
+ * again until it is finished.
+ * @param task Task to wait for.
+ * @param next Task to run after @a task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - @a task is not pushed to a
+ *       pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is already in a pool.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/**
+ * Like thread_task_then(), but @a next waits for all the @a count
+ * tasks. They all must be pushed into the same pool.
+ * @param tasks Tasks to wait for.
+ * @param count Size of @a tasks.
+ * @param next Task to run after all @a tasks.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the tasks are in different
+ *       pools, or @a count is not positive.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - one of @a tasks is not pushed
+ *       to a pool.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is already in a pool.
+ */
+int
+thread_task_when_all(struct thread_task **tasks, int count,
+		     struct thread_task *next);
+
 #if NEED_DETACH
 
 /**
@@ -174,3 +397,98 @@ int
 thread_task_detach(struct thread_task *task);
 
 #endif
+
+/**
+ * Cancel a task. A queued task is removed from the queue and
+ * finished right away without running, its continuations are
+ * released. A waiting one is finished without running when its
+ * prerequisites are. A running one is only flagged, its function
+ * can check thread_task_is_cancelled() and return early. A finished
+ * task is not affected.
+ * @param task Task to cancel.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ */
+int
+thread_task_cancel(struct thread_task *task);
+
+/**
+ * Check if @a task was cancelled. Safe to call from the task
+ * function while it is running.
+ * @param task Task to check.
+ */
+bool
+thread_task_is_cancelled(const struct thread_task *task);
+
+/** Parallel loops on top of the pool. */
+
+/**
+ * Body of a parallel loop, processes indexes [@a begin, @a end).
+ */
+typedef void (*thread_range_f)(size_t begin, size_t end, void *ctx);
+
+/**
+ * Body of a parallel reduction. Processes indexes [@a begin, @a end)
+ * and accumulates the result into @a acc.
+ */
+typedef void (*thread_reduce_f)(size_t begin, size_t end, void *acc,
+				void *ctx);
+
+/**
+ * Merge the accumulator @a other into @a acc.
+ */
+typedef void (*thread_combine_f)(void *acc, const void *other, void *ctx);
+
+/**
+ * Run @a fn over the range [@a begin, @a end) in parallel and wait
+ * until it is done. The calling thread takes part in the work, so it
+ * is fine to call it from a pool task. The range is split on demand:
+ * an idle participant steals the upper half of the biggest remaining
+ * range of somebody else, and a range not bigger than @a grain is
+ * stolen whole. Each participant gives its range to @a fn by parts of
+ * at most @a grain indexes. Returns once all the helper tasks are
+ * done, so the pool can be deleted right after.
+ * @param pool Pool to take the helper threads from.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Maximal range part size to give to @a fn. 0 means 1.
+ * @param fn Loop body.
+ * @param ctx Argument for @a fn.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool or no function.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end,
+			 size_t grain, thread_range_f fn, void *ctx);
+
+/**
+ * Like thread_pool_parallel_for(), but each participant accumulates
+ * its parts into an own copy of @a result, and at the end they all
+ * are merged into @a result via @a combine. The parts are processed
+ * and merged in no particular order, so @a combine has to be
+ * associative and commutative.
+ * @param pool Pool to take the helper threads from.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Maximal range part size to give to @a fn. 0 means 1.
+ * @param fn Reduction body.
+ * @param combine Accumulator merge function.
+ * @param ctx Argument for @a fn and @a combine.
+ * @param[in][out] result Accumulator. Must hold the identity value
+ *   on input, like 0 for a sum.
+ * @param result_size Size of the accumulator in bytes.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no pool, no functions or no
+ *       accumulator.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin,
+			    size_t end, size_t grain, thread_reduce_f fn,
+			    thread_combine_f combine, void *ctx, void *result,
+			    size_t result_size);